@@ -1,6 +1,20 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#ifndef MIPT_CONDITIONAL
+#define MIPT_CONDITIONAL
+
 template <bool B, typename T, typename F>
 struct conditional {
   using type = F;
@@ -14,23 +28,135 @@ struct conditional<true, T, F> {
 template <bool B, typename T, typename F>
 using conditional_t = typename conditional<B, T, F>::type;
 
+#endif
+
+const size_t DequeBlockBytes = 4096;
+
+// Elements per Deque block: the largest power of two that still fits into
+// DequeBlockBytes (at least one), so that indexing reduces to shifts and masks.
 template <typename T>
+constexpr size_t deque_row_size() {
+  size_t row_size = 1;
+  while (row_size * 2 * sizeof(T) <= DequeBlockBytes) {
+    row_size *= 2;
+  }
+  return row_size;
+}
+
+constexpr size_t deque_log2(size_t num) {
+  size_t result = 0;
+  while (num > 1) {
+    num >>= 1;
+    ++result;
+  }
+  return result;
+}
+
+template <typename T, typename Alloc = std::allocator<T>,
+          size_t RowSize = deque_row_size<T>()>
 class Deque {
  private:
-  static const size_t RowSize = 32;
+  static_assert(RowSize > 0 && (RowSize & (RowSize - 1)) == 0,
+                "Deque row size must be a power of two");
+
+  using AllocTraits = std::allocator_traits<Alloc>;
+  using MapAlloc = typename AllocTraits::template rebind_alloc<T*>;
+  using BlockAlloc = typename AllocTraits::template rebind_alloc<T>;
+
+  static const size_t RowShift = deque_log2(RowSize);
+  static const size_t RowMask = RowSize - 1;
+
+  template <typename A, typename = void>
+  struct has_construct : std::false_type {};
+
+  template <typename A>
+  struct has_construct<A, std::void_t<decltype(std::declval<A&>().construct(
+                              std::declval<T*>(), std::declval<const T&>()))>>
+      : std::true_type {};
+
+  template <typename A, typename = void>
+  struct has_destroy : std::false_type {};
+
+  template <typename A>
+  struct has_destroy<A, std::void_t<decltype(std::declval<A&>().destroy(std::declval<T*>()))>>
+      : std::true_type {};
+
+  // Elements may be created with memcpy/memset instead of the allocator.
+  static constexpr bool BitwiseCopy =
+      std::is_trivially_copyable_v<T> &&
+      (!has_construct<Alloc>::value || std::is_same_v<Alloc, std::allocator<T>>);
+
+  // Allocators whose destroy is known to be a plain destructor call. This
+  // is checked first so that has_destroy never names the member that
+  // polymorphic_allocator deprecates.
+  static constexpr bool PlainDestroy =
+      std::is_same_v<Alloc, std::allocator<T>> ||
+      std::is_same_v<Alloc, std::pmr::polymorphic_allocator<T>>;
+
+  // Elements may be dropped without calling the allocator.
+  static constexpr bool TrivialDestroy =
+      std::is_trivially_destructible_v<T> &&
+      std::disjunction_v<std::bool_constant<PlainDestroy>, std::negation<has_destroy<Alloc>>>;
+
+  template <typename It>
+  static constexpr bool is_contiguous() {
+#if defined(__cpp_lib_concepts)
+    if constexpr (std::contiguous_iterator<It>) {
+      return std::is_same_v<std::iter_value_t<It>, T>;
+    }
+#endif
+    return std::is_pointer_v<It> && std::is_same_v<std::remove_cv_t<std::remove_pointer_t<It>>, T>;
+  }
+  static const size_t SpareBlocks = 4;
   size_t size_ = 0;
   size_t num_columns_ = 1;
   size_t head_column_index_ = 0;
   size_t head_row_index_ = 0;
   size_t tail_column_index_ = 0;
   size_t tail_row_index_ = 0;
-  T** arr_;
+  // A moved-from deque keeps this one-row map without a block, so that
+  // moving never allocates; the first insertion grows it like any other.
+  T* empty_row_ = nullptr;
+  T** arr_ = &empty_row_;
+  T* spare_blocks_[SpareBlocks] = {};
+  size_t spare_count_ = 0;
+  double shrink_threshold_ = 0;
+  Alloc alloc_;
 
+  // Keeps the bounds of the current block next to the element pointer, so
+  // that stepping is a pointer bump and the map is touched only on a hop.
   template <bool IsConst>
   class common_iterator {
+    friend class Deque;
+
+    template <bool OtherConst>
+    friend class common_iterator;
+
    private:
-    T** ptr = nullptr;
-    int pos = 0;
+    T* cur = nullptr;
+    T* first = nullptr;
+    T* last = nullptr;
+    T** node = nullptr;
+
+    void set_node(T** new_node) {
+      node = new_node;
+      first = *new_node;
+      last = first + RowSize;
+    }
+
+    // Calls f(data, count) for every contiguous run in [from, to) until f
+    // returns true.
+    template <typename F>
+    static void walk_segments(common_iterator from, common_iterator to, F f) {
+      while (from.node != to.node) {
+        if (f(static_cast<pointer>(from.cur), static_cast<size_t>(from.last - from.cur))) {
+          return;
+        }
+        from.set_node(from.node + 1);
+        from.cur = from.first;
+      }
+      f(static_cast<pointer>(from.cur), static_cast<size_t>(to.cur - from.cur));
+    }
 
    public:
     using difference_type = std::ptrdiff_t;
@@ -38,10 +164,14 @@ class Deque {
     using iterator_category = std::random_access_iterator_tag;
     using pointer = conditional_t<IsConst, const T*, T*>;
     using reference = conditional_t<IsConst, const T&, T&>;
-    common_iterator(T*& ptr, int pos) : ptr(&ptr), pos(pos) {}
+
+    common_iterator() = default;
+
+    common_iterator(T*& row, difference_type pos)
+        : cur(row + pos), first(row), last(row + RowSize), node(&row) {}
 
     common_iterator(const common_iterator& copy)
-        : ptr(copy.ptr), pos(copy.pos) {}
+        : cur(copy.cur), first(copy.first), last(copy.last), node(copy.node) {}
 
     common_iterator& operator=(const common_iterator& other) {
       common_iterator copy(other);
@@ -50,23 +180,26 @@ class Deque {
     }
 
     void swap(common_iterator& copy) {
-      std::swap(ptr, copy.ptr);
-      std::swap(pos, copy.pos);
+      std::swap(cur, copy.cur);
+      std::swap(first, copy.first);
+      std::swap(last, copy.last);
+      std::swap(node, copy.node);
     }
 
     common_iterator& operator++() {
-      if (pos + 1 == RowSize) {
-        ++ptr;
+      if (++cur == last) {
+        set_node(node + 1);
+        cur = first;
       }
-      pos = (pos + 1) % RowSize;
       return *this;
     }
 
     common_iterator& operator--() {
-      if (pos == 0) {
-        --ptr;
+      if (cur == first) {
+        set_node(node - 1);
+        cur = last;
       }
-      pos = (pos + RowSize - 1) % RowSize;
+      --cur;
       return *this;
     }
 
@@ -82,91 +215,708 @@ class Deque {
       return copy;
     }
 
-    common_iterator& operator+=(int num) {
-      if (num >= 0) {
-        if (num + pos >= static_cast<int>(RowSize)) {
-          ptr += (num + pos) / RowSize;
-        }
-        pos = (num + pos) % RowSize;
+    common_iterator& operator+=(difference_type num) {
+      difference_type offset = num + (cur - first);
+      if (offset >= 0 && offset < static_cast<difference_type>(RowSize)) {
+        cur += num;
       } else {
-        num = -num;
-        if (num > pos) {
-          ptr -= (num - pos + RowSize - 1) / RowSize;
-        }
-        pos = (pos - num) % RowSize;
+        set_node(node + (offset >> RowShift));
+        cur = first + (offset & RowMask);
       }
       return *this;
     }
 
-    common_iterator operator+(int num) const {
+    common_iterator operator+(difference_type num) const {
       common_iterator copy = *this;
       copy += num;
       return copy;
     }
 
-    common_iterator operator-(int num) const {
+    friend common_iterator operator+(difference_type num, const common_iterator& it) {
+      return it + num;
+    }
+
+    common_iterator operator-(difference_type num) const {
       common_iterator copy = *this;
       copy -= num;
       return copy;
     }
 
-    common_iterator& operator-=(int num) {
+    common_iterator& operator-=(difference_type num) {
       *this += -num;
       return *this;
     }
 
-    bool operator==(const common_iterator<IsConst>& other) const {
-      return ptr == other.ptr && pos == other.pos;
+    template <bool OtherConst>
+    bool operator==(const common_iterator<OtherConst>& other) const {
+      return cur == other.cur;
     }
 
-    bool operator<(const common_iterator<IsConst>& other) const {
-      if (ptr == other.ptr) {
-        return pos < other.pos;
+    template <bool OtherConst>
+    bool operator<(const common_iterator<OtherConst>& other) const {
+      if (node == other.node) {
+        return cur < other.cur;
       }
-      return ptr < other.ptr;
+      return node < other.node;
     }
 
-    bool operator!=(const common_iterator<IsConst>& other) const {
+    template <bool OtherConst>
+    bool operator!=(const common_iterator<OtherConst>& other) const {
       return !(*this == other);
     }
 
-    bool operator>(const common_iterator<IsConst>& other) const {
+    template <bool OtherConst>
+    bool operator>(const common_iterator<OtherConst>& other) const {
       return other < *this;
     }
 
-    bool operator<=(const common_iterator<IsConst>& other) const {
-      return *this == other || *this < other;
+    template <bool OtherConst>
+    bool operator<=(const common_iterator<OtherConst>& other) const {
+      return !(other < *this);
+    }
+
+    template <bool OtherConst>
+    bool operator>=(const common_iterator<OtherConst>& other) const {
+      return !(*this < other);
+    }
+
+    reference operator*() const { return *cur; }
+
+    pointer operator->() const { return cur; }
+
+    reference operator[](difference_type num) const { return *(*this + num); }
+
+    template <bool OtherConst>
+    difference_type operator-(const common_iterator<OtherConst>& other) const {
+      return (node - other.node) * static_cast<difference_type>(RowSize) +
+             (cur - first) - (other.cur - other.first);
+    }
+
+    operator common_iterator<true>() const {
+      common_iterator<true> result;
+      result.cur = cur;
+      result.first = first;
+      result.last = last;
+      result.node = node;
+      return result;
+    }
+
+    // Block-wise versions of the standard algorithms: each block is handed to
+    // the pointer overloads, which the compiler can vectorise. They are found
+    // by argument-dependent lookup, so an unqualified call (or one after
+    // `using std::copy;`) picks them over the element-by-element std versions.
+    template <typename OutputIt>
+    friend OutputIt copy(common_iterator from, common_iterator to, OutputIt out) {
+      walk_segments(from, to, [&out](pointer data, size_t count) {
+        out = std::copy(data, data + count, out);
+        return false;
+      });
+      return out;
+    }
+
+    friend void fill(common_iterator from, common_iterator to, const T& value) {
+      walk_segments(from, to, [&value](pointer data, size_t count) {
+        std::fill(data, data + count, value);
+        return false;
+      });
+    }
+
+    friend common_iterator find(common_iterator from, common_iterator to, const T& value) {
+      while (true) {
+        T* end = from.node == to.node ? to.cur : from.last;
+        T* found = std::find(from.cur, end, value);
+        if (found != end) {
+          from.cur = found;
+          return from;
+        }
+        if (from.node == to.node) {
+          return to;
+        }
+        from.set_node(from.node + 1);
+        from.cur = from.first;
+      }
+    }
+
+    friend difference_type count(common_iterator from, common_iterator to, const T& value) {
+      difference_type result = 0;
+      walk_segments(from, to, [&result, &value](pointer data, size_t count) {
+        result += std::count(data, data + count, value);
+        return false;
+      });
+      return result;
+    }
+
+    template <typename U>
+    friend U accumulate(common_iterator from, common_iterator to, U init) {
+      walk_segments(from, to, [&init](pointer data, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+          init = std::move(init) + data[i];
+        }
+        return false;
+      });
+      return init;
+    }
+
+    template <typename InputIt>
+    friend bool equal(common_iterator from, common_iterator to, InputIt other) {
+      bool result = true;
+      walk_segments(from, to, [&result, &other](pointer data, size_t count) {
+        using category = typename std::iterator_traits<InputIt>::iterator_category;
+        if constexpr (std::is_base_of_v<std::forward_iterator_tag, category>) {
+          result = std::equal(data, data + count, other);
+          std::advance(other, count);
+        } else {
+          for (size_t i = 0; i < count && result; ++i, ++other) {
+            result = data[i] == *other;
+          }
+        }
+        return !result;
+      });
+      return result;
+    }
+  };
+
+  T** allocate_map(size_t num_columns) {
+    MapAlloc map_alloc(alloc_);
+    return std::allocator_traits<MapAlloc>::allocate(map_alloc, num_columns);
+  }
+
+  void deallocate_map(T** map, size_t num_columns) {
+    if (map == &empty_row_) {
+      return;
+    }
+    MapAlloc map_alloc(alloc_);
+    std::allocator_traits<MapAlloc>::deallocate(map_alloc, map, num_columns);
+  }
+
+  T* allocate_block() {
+    BlockAlloc block_alloc(alloc_);
+    return std::allocator_traits<BlockAlloc>::allocate(block_alloc, RowSize);
+  }
+
+  void deallocate_block(T* block) {
+    BlockAlloc block_alloc(alloc_);
+    std::allocator_traits<BlockAlloc>::deallocate(block_alloc, block, RowSize);
+  }
+
+  // Blocks are handed out lazily: only rows between head and tail are
+  // guaranteed to own one. Blocks that fall out of that range go to a small
+  // spare cache first, so queue-like usage keeps recycling the same memory.
+  T* acquire_block() {
+    if (spare_count_ > 0) {
+      return spare_blocks_[--spare_count_];
+    }
+    return allocate_block();
+  }
+
+  void release_block(T* block) {
+    if (spare_count_ < SpareBlocks) {
+      spare_blocks_[spare_count_++] = block;
+    } else {
+      deallocate_block(block);
+    }
+  }
+
+  void ensure_blocks(size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      if (arr_[i] == nullptr) {
+        arr_[i] = acquire_block();
+      }
+    }
+  }
+
+  void release_blocks(size_t first_row, size_t last_row) {
+    for (size_t i = first_row; i < last_row; ++i) {
+      if (arr_[i] != nullptr) {
+        release_block(arr_[i]);
+        arr_[i] = nullptr;
+      }
+    }
+  }
+
+  void reserve() {
+    arr_ = allocate_map(num_columns_);
+    std::fill(arr_, arr_ + num_columns_, nullptr);
+    try {
+      ensure_blocks(head_row_index_, tail_row_index_ + 1);
+    } catch (...) {
+      free_storage();
+      throw;
+    }
+  }
+
+  void free_storage() {
+    for (size_t i = 0; i < num_columns_; ++i) {
+      if (arr_[i] != nullptr) {
+        deallocate_block(arr_[i]);
+      }
+    }
+    for (size_t i = 0; i < spare_count_; ++i) {
+      deallocate_block(spare_blocks_[i]);
+    }
+    deallocate_map(arr_, num_columns_);
+  }
+
+  // Frees the blocks of unused rows and moves the used rows into the middle
+  // of a map twice their size, so that a queue drifting along the map can
+  // keep recentring without growing it again. If the smaller map cannot be
+  // allocated, only the blocks are released.
+  void trim_map() {
+    for (size_t i = 0; i < num_columns_; ++i) {
+      if ((i < head_row_index_ || i > tail_row_index_) && arr_[i] != nullptr) {
+        deallocate_block(arr_[i]);
+        arr_[i] = nullptr;
+      }
+    }
+    size_t used = tail_row_index_ - head_row_index_ + 1;
+    size_t new_num_columns = used * 2 + 2;
+    if (new_num_columns >= num_columns_) {
+      return;
+    }
+    T** new_deque;
+    try {
+      new_deque = allocate_map(new_num_columns);
+    } catch (...) {
+      return;
+    }
+    size_t new_head = (new_num_columns - used) / 2;
+    std::fill(new_deque, new_deque + new_num_columns, nullptr);
+    std::copy(arr_ + head_row_index_, arr_ + tail_row_index_ + 1, new_deque + new_head);
+    deallocate_map(arr_, num_columns_);
+    arr_ = new_deque;
+    num_columns_ = new_num_columns;
+    head_row_index_ = new_head;
+    tail_row_index_ = new_head + used - 1;
+  }
+
+  void auto_shrink() {
+    if (shrink_threshold_ > 0 &&
+        num_columns_ > (tail_row_index_ - head_row_index_ + 2) * 2 &&
+        static_cast<double>(size_) < shrink_threshold_ * static_cast<double>(num_columns_ << RowShift)) {
+      trim_map();
+    }
+  }
+
+  // Makes sure there are at least front_rows map slots before the head row
+  // and back_rows after the tail row. Only block pointers move: the map is
+  // recentred in place while it is at most half full, and is grown otherwise.
+  void reallocate(size_t front_rows, size_t back_rows) {
+    if (head_row_index_ >= front_rows && tail_row_index_ + back_rows < num_columns_) {
+      return;
+    }
+    size_t used = tail_row_index_ - head_row_index_ + 1;
+    size_t needed = used + front_rows + back_rows;
+    if (needed * 2 <= num_columns_) {
+      size_t new_head = front_rows + (num_columns_ - needed) / 2;
+      if (new_head < head_row_index_) {
+        std::rotate(arr_, arr_ + (head_row_index_ - new_head), arr_ + num_columns_);
+      } else {
+        std::rotate(arr_, arr_ + num_columns_ - (new_head - head_row_index_), arr_ + num_columns_);
+      }
+      tail_row_index_ = new_head + used - 1;
+      head_row_index_ = new_head;
+      return;
+    }
+    size_t shift = std::max(num_columns_, front_rows);
+    size_t new_num_columns = shift + num_columns_ + std::max(num_columns_, back_rows);
+    T** new_deque = allocate_map(new_num_columns);
+    std::fill(new_deque, new_deque + new_num_columns, nullptr);
+    std::copy(arr_, arr_ + num_columns_, new_deque + shift);
+    deallocate_map(arr_, num_columns_);
+    arr_ = new_deque;
+    head_row_index_ += shift;
+    tail_row_index_ += shift;
+    num_columns_ = new_num_columns;
+  }
+
+  template <typename InputIt, typename ForwardIt>
+  void construct_range(InputIt first, InputIt last, ForwardIt dest) {
+    ForwardIt current = dest;
+    try {
+      for (; first != last; ++first, ++current) {
+        AllocTraits::construct(alloc_, std::addressof(*current), *first);
+      }
+    } catch (...) {
+      destroy_range(dest, current);
+      throw;
+    }
+  }
+
+  template <typename ForwardIt>
+  void destroy_range(ForwardIt first, ForwardIt last) {
+    if constexpr (!TrivialDestroy) {
+      for (; first != last; ++first) {
+        AllocTraits::destroy(alloc_, std::addressof(*first));
+      }
+    }
+  }
+
+  // Move-assigns [first, last) onto dest one block-sized run at a time, with
+  // memmove for trivially copyable T. As with std::move, dest may overlap the
+  // source only if it comes before it.
+  template <typename It>
+  static void move_segments(It first, It last, It dest) {
+    size_t count = last - first;
+    while (count > 0) {
+      size_t n = std::min({count, static_cast<size_t>(first.last - first.cur),
+                           static_cast<size_t>(dest.last - dest.cur)});
+      if constexpr (std::is_trivially_copyable_v<T>) {
+        std::memmove(static_cast<void*>(dest.cur), first.cur, n * sizeof(T));
+      } else {
+        std::move(first.cur, first.cur + n, dest.cur);
+      }
+      first += n;
+      dest += n;
+      count -= n;
+    }
+  }
+
+  // The std::move_backward counterpart of move_segments.
+  template <typename It>
+  static void move_segments_backward(It first, It last, It dest_last) {
+    size_t count = last - first;
+    while (count > 0) {
+      size_t n = std::min({count, run_before(last), run_before(dest_last)});
+      last -= n;
+      dest_last -= n;
+      count -= n;
+      if constexpr (std::is_trivially_copyable_v<T>) {
+        std::memmove(static_cast<void*>(dest_last.cur), last.cur, n * sizeof(T));
+      } else {
+        std::move_backward(last.cur, last.cur + n, dest_last.cur + n);
+      }
+    }
+  }
+
+  // Number of elements of the block run that ends at it.
+  template <typename It>
+  static size_t run_before(const It& it) {
+    return it.cur == it.first ? RowSize : static_cast<size_t>(it.cur - it.first);
+  }
+
+  // Move-constructs [first, last) into the raw slots starting at dest.
+  template <typename It>
+  void move_construct(It first, It last, It dest) {
+    if constexpr (BitwiseCopy) {
+      move_segments(first, last, dest);
+    } else {
+      construct_range(std::make_move_iterator(first), std::make_move_iterator(last), dest);
+    }
+  }
+
+  // Constructs count values taken from first into the raw slots starting at
+  // dest, a block at a time, and leaves first past the last value used.
+  template <typename It, typename ForwardIt>
+  void construct_segments(It dest, size_t count, ForwardIt& first) {
+    size_t done = 0;
+    try {
+      It::walk_segments(dest, dest + count, [this, &first, &done](T* data, size_t n) {
+        construct_block(data, n, first);
+        done += n;
+        return false;
+      });
+    } catch (...) {
+      destroy_range(dest, dest + done);
+      throw;
+    }
+  }
+
+  // Assigns count values taken from first to the elements starting at dest.
+  template <typename It, typename ForwardIt>
+  void assign_segments(It dest, size_t count, ForwardIt& first) {
+    It::walk_segments(dest, dest + count, [&first](T* data, size_t n) {
+      if constexpr (std::is_trivially_copyable_v<T> && is_contiguous<ForwardIt>()) {
+        if (n != 0) {
+          std::memmove(static_cast<void*>(data), std::addressof(*first), n * sizeof(T));
+          first += n;
+        }
+      } else if constexpr (std::is_same_v<ForwardIt, repeat_iterator>) {
+        std::fill_n(data, n, *first);
+        first += n;
+      } else {
+        for (size_t i = 0; i < n; ++i, ++first) {
+          data[i] = *first;
+        }
+      }
+      return false;
+    });
+  }
+
+  void swap_data(Deque& other) {
+    std::swap(spare_blocks_, other.spare_blocks_);
+    std::swap(spare_count_, other.spare_count_);
+    std::swap(shrink_threshold_, other.shrink_threshold_);
+    std::swap(head_column_index_, other.head_column_index_);
+    std::swap(head_row_index_, other.head_row_index_);
+    std::swap(tail_column_index_, other.tail_column_index_);
+    std::swap(tail_row_index_, other.tail_row_index_);
+    std::swap(num_columns_, other.num_columns_);
+    std::swap(size_, other.size_);
+    bool own_empty = arr_ == &empty_row_;
+    bool other_empty = other.arr_ == &other.empty_row_;
+    std::swap(arr_, other.arr_);
+    std::swap(empty_row_, other.empty_row_);
+    if (other_empty) {
+      arr_ = &empty_row_;
+    }
+    if (own_empty) {
+      other.arr_ = &other.empty_row_;
+    }
+  }
+
+  void swap_all(Deque& other) {
+    swap_data(other);
+    std::swap(alloc_, other.alloc_);
+  }
+
+  class repeat_iterator {
+   private:
+    const T* value_;
+    size_t index_;
+
+   public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = T;
+    using iterator_category = std::forward_iterator_tag;
+    using pointer = const T*;
+    using reference = const T&;
+
+    repeat_iterator(const T& value, size_t index) : value_(&value), index_(index) {}
+
+    repeat_iterator& operator++() {
+      ++index_;
+      return *this;
     }
 
-    bool operator>=(const common_iterator<IsConst>& other) const {
-      return *this == other || *this > other;
+    repeat_iterator operator++(int) {
+      repeat_iterator copy = *this;
+      ++index_;
+      return copy;
     }
 
-    reference operator*() const { return *((*ptr) + pos); }
+    repeat_iterator& operator+=(size_t count) {
+      index_ += count;
+      return *this;
+    }
 
-    pointer operator->() const { return &((*ptr)[pos]); }
+    bool operator==(const repeat_iterator& other) const {
+      return index_ == other.index_;
+    }
 
-    difference_type operator-(const common_iterator<IsConst>& other) const {
-      return (ptr - other.ptr) * RowSize + (pos - other.pos);
+    bool operator!=(const repeat_iterator& other) const {
+      return index_ != other.index_;
     }
 
-    operator common_iterator<true>() { return common_iterator<true>(ptr, pos); }
+    reference operator*() const { return *value_; }
   };
 
-  void reserve(size_t num_columns) {
-      arr_ = new T*[num_columns];
-      size_t i;
+  size_t head_position() const {
+    return (head_row_index_ << RowShift) + head_column_index_;
+  }
+
+  size_t tail_position() const {
+    return (tail_row_index_ << RowShift) + tail_column_index_;
+  }
+
+  void set_head_position(size_t position) {
+    head_row_index_ = position >> RowShift;
+    head_column_index_ = position & RowMask;
+  }
+
+  void set_tail_position(size_t position) {
+    tail_row_index_ = position >> RowShift;
+    tail_column_index_ = position & RowMask;
+  }
+
+  void reserve_front(size_t count) {
+    if (count <= head_column_index_) {
+      return;
+    }
+    size_t rows = (count - head_column_index_ + RowMask) >> RowShift;
+    reallocate(rows, 0);
+    ensure_blocks(head_row_index_ - rows, head_row_index_ + 1);
+  }
+
+  void reserve_back(size_t count) {
+    size_t rows = (tail_column_index_ + count) >> RowShift;
+    reallocate(0, rows);
+    ensure_blocks(tail_row_index_, tail_row_index_ + rows + 1);
+  }
+
+  template <typename ForwardIt>
+  void construct_block(T* data, size_t count, ForwardIt& first) {
+    if constexpr (BitwiseCopy && is_contiguous<ForwardIt>()) {
+      if (count != 0) {
+        std::memcpy(data, std::addressof(*first), count * sizeof(T));
+        first += count;
+      }
+    } else if constexpr (BitwiseCopy && std::is_same_v<ForwardIt, repeat_iterator>) {
+      std::fill_n(data, count, *first);
+      first += count;
+    } else {
+      size_t i = 0;
       try {
-          for (i = 0; i < num_columns; ++i) {
-              arr_[i] = reinterpret_cast<T*>(new uint8_t[sizeof(T) * RowSize]);
-          }
-      } catch(...) {
-          for (size_t j = 0; j < i; ++j) {
-              delete[] reinterpret_cast<uint8_t*>(arr_[j]);
-          }
-          delete[] arr_;
+        for (; i < count; ++i, ++first) {
+          AllocTraits::construct(alloc_, data + i, *first);
+        }
+      } catch (...) {
+        for (size_t j = 0; j < i; ++j) {
+          AllocTraits::destroy(alloc_, data + j);
+        }
+        throw;
+      }
+    }
+  }
+
+  void construct_default_block(T* data, size_t count) {
+    if constexpr (BitwiseCopy && std::is_trivially_default_constructible_v<T>) {
+      std::memset(static_cast<void*>(data), 0, count * sizeof(T));
+    } else {
+      size_t i = 0;
+      try {
+        for (; i < count; ++i) {
+          AllocTraits::construct(alloc_, data + i);
+        }
+      } catch (...) {
+        for (size_t j = 0; j < i; ++j) {
+          AllocTraits::destroy(alloc_, data + j);
+        }
+        throw;
+      }
+    }
+  }
+
+  // Grows the map once for all count elements, then constructs them block by
+  // block behind the tail with fill(data, n). Nothing is committed until every
+  // block is built, so a throwing constructor leaves the deque unchanged.
+  template <typename Filler>
+  void append_blocks(size_t count, Filler fill) {
+    if (count == 0) {
+      return;
+    }
+    reserve_back(count);
+    iterator old_end = end();
+    size_t done = 0;
+    try {
+      iterator::walk_segments(old_end, old_end + count, [&fill, &done](T* data, size_t n) {
+        fill(data, n);
+        done += n;
+        return false;
+      });
+    } catch (...) {
+      destroy_range(old_end, old_end + done);
+      throw;
+    }
+    set_tail_position(tail_position() + count);
+    size_ += count;
+  }
+
+  template <typename ForwardIt>
+  void append_n(size_t count, ForwardIt first) {
+    append_blocks(count, [this, &first](T* data, size_t n) { construct_block(data, n, first); });
+  }
+
+  template <typename InputIt>
+  void append(InputIt first, InputIt last) {
+    using category = typename std::iterator_traits<InputIt>::iterator_category;
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, category>) {
+      append_n(std::distance(first, last), first);
+    } else {
+      size_t old_size = size_;
+      try {
+        for (; first != last; ++first) {
+          emplace_back(*first);
+        }
+      } catch (...) {
+        while (size_ > old_size) {
+          pop_back();
+        }
+        throw;
+      }
+    }
+  }
+
+  // Inserts count values taken from first before index, shifting only the
+  // shorter side. Every shifted element is moved exactly once; the raw slots
+  // next to head or tail are filled first. The new values that land on
+  // existing elements are assigned last; if one of them throws, the shift is
+  // moved back, so the deque is left unchanged whenever move assignment of T
+  // cannot throw (otherwise the deque stays valid but its contents are
+  // unspecified).
+  template <typename ForwardIt>
+  void insert_range(size_t index, size_t count, ForwardIt first) {
+    if (count == 0) {
+      return;
+    }
+    if (index < size_ - index) {
+      reserve_front(count);
+      iterator old_begin = begin();
+      iterator new_begin = old_begin - count;
+      iterator gap = old_begin;
+      size_t gap_size = index;
+      if (count <= index) {
+        move_construct(old_begin, old_begin + count, new_begin);
+        move_segments(old_begin + count, old_begin + index, old_begin);
+        gap += index - count;
+        gap_size = count;
+      } else {
+        ForwardIt middle = first;
+        construct_segments(new_begin + index, count - index, middle);
+        try {
+          move_construct(old_begin, old_begin + index, new_begin);
+        } catch (...) {
+          destroy_range(new_begin + index, old_begin);
           throw;
+        }
+        first = middle;
       }
+      set_head_position(head_position() - count);
+      size_ += count;
+      try {
+        assign_segments(gap, gap_size, first);
+      } catch (...) {
+        if constexpr (std::is_nothrow_move_assignable_v<T>) {
+          move_segments_backward(new_begin, new_begin + index, old_begin + index);
+          destroy_range(new_begin, old_begin);
+          set_head_position(head_position() + count);
+          size_ -= count;
+        }
+        throw;
+      }
+    } else {
+      reserve_back(count);
+      size_t after = size_ - index;
+      iterator old_end = end();
+      iterator position = begin() + index;
+      size_t gap_size = after;
+      if (count <= after) {
+        move_construct(old_end - count, old_end, old_end);
+        move_segments_backward(position, old_end - count, old_end);
+        gap_size = count;
+      } else {
+        ForwardIt middle = std::next(first, after);
+        construct_segments(old_end, count - after, middle);
+        try {
+          move_construct(position, old_end, old_end + (count - after));
+        } catch (...) {
+          destroy_range(old_end, old_end + (count - after));
+          throw;
+        }
+      }
+      set_tail_position(tail_position() + count);
+      size_ += count;
+      try {
+        assign_segments(position, gap_size, first);
+      } catch (...) {
+        if constexpr (std::is_nothrow_move_assignable_v<T>) {
+          move_segments(position + count, old_end + count, position);
+          destroy_range(old_end, old_end + count);
+          set_tail_position(tail_position() - count);
+          size_ -= count;
+        }
+        throw;
+      }
+    }
   }
 
  public:
@@ -220,101 +970,170 @@ class Deque {
     return std::make_reverse_iterator(cbegin());
   }
 
-  Deque() {
-    arr_ = new T*[1];
-    try {
-        arr_[0] = reinterpret_cast<T*>(new uint8_t[sizeof(T) * RowSize]);
-    } catch(...) {
-        delete[] arr_;
-    }
+  explicit Deque(const Alloc& alloc = Alloc()) : alloc_(alloc) {
+    reserve();
   }
 
+  Deque(Deque&& other) noexcept : alloc_(other.alloc_) { swap_data(other); }
+
   Deque(const Deque& other)
+      : Deque(other, AllocTraits::select_on_container_copy_construction(other.alloc_)) {}
+
+  Deque(const Deque& other, const Alloc& alloc)
       : size_(other.size_),
         num_columns_(other.num_columns_),
         head_column_index_(other.head_column_index_),
         head_row_index_(other.head_row_index_),
         tail_column_index_(other.tail_column_index_),
-        tail_row_index_(other.tail_row_index_) {
-    reserve(num_columns_);
+        tail_row_index_(other.tail_row_index_),
+        shrink_threshold_(other.shrink_threshold_),
+        alloc_(alloc) {
+    reserve();
     size_t count = 0;
     try {
       for (size_t i = head_row_index_; i <= tail_row_index_; ++i) {
         size_t first = (i == head_row_index_) ? head_column_index_ : 0;
         size_t last = (i == tail_row_index_) ? tail_column_index_ : RowSize;
-        for (size_t j = first; j < last; ++j) {
-          new (arr_[i] + j) T(other.arr_[i][j]);
-          ++count;
-        }
+        const T* source = other.arr_[i] + first;
+        construct_block(arr_[i] + first, last - first, source);
+        count += last - first;
       }
     } catch (...) {
       for (size_t i = 0; i < count; ++i) {
-        (*this)[i].~T();
+        AllocTraits::destroy(alloc_, &(*this)[i]);
       }
-      for (size_t i = 0; i < other.num_columns_; ++i) {
-        delete[] reinterpret_cast<uint8_t*>(arr_[i]);
-      }
-      delete[] arr_;
+      free_storage();
       throw;
     }
   }
 
   void swap(Deque& other) {
-    std::swap(head_column_index_, other.head_column_index_);
-    std::swap(head_row_index_, other.head_row_index_);
-    std::swap(tail_column_index_, other.tail_column_index_);
-    std::swap(tail_row_index_, other.tail_row_index_);
-    std::swap(num_columns_, other.num_columns_);
-    std::swap(size_, other.size_);
-    std::swap(arr_, other.arr_);
+    swap_data(other);
+    if constexpr (AllocTraits::propagate_on_container_swap::value) {
+      std::swap(alloc_, other.alloc_);
+    }
   }
 
-  Deque<T>& operator=(const Deque& other) {
-    Deque<T> copy(other);
-    swap(copy);
+  Deque& operator=(const Deque& other) {
+    if constexpr (AllocTraits::propagate_on_container_copy_assignment::value) {
+      Deque copy(other, other.alloc_);
+      swap_all(copy);
+    } else {
+      Deque copy(other, alloc_);
+      swap_data(copy);
+    }
     return *this;
   }
 
-  Deque(size_t num, const T& value = T())
-      : size_(num),
-        num_columns_((num / RowSize + 1) * 3),
-        head_column_index_(0),
-        head_row_index_(num_columns_ / 2),
-        tail_column_index_(num % RowSize),
-        tail_row_index_(head_row_index_ + num / RowSize) {
-      reserve(num_columns_);
-    size_t count = 0;
-    try {
-      for (size_t i = head_row_index_; i <= tail_row_index_; ++i) {
-        size_t first = (i == head_row_index_) ? head_column_index_ : 0;
-        size_t last = (i == tail_row_index_) ? tail_column_index_ : RowSize;
-        for (size_t j = first; j < last; ++j) {
-          new (arr_[i] + j) T(value);
-          ++count;
+  Deque& operator=(Deque&& other) noexcept(
+      AllocTraits::propagate_on_container_move_assignment::value ||
+      AllocTraits::is_always_equal::value) {
+    if (this == &other) {
+      return *this;
+    }
+    if constexpr (AllocTraits::propagate_on_container_move_assignment::value) {
+      swap_all(other);
+    } else if constexpr (AllocTraits::is_always_equal::value) {
+      swap_data(other);
+    } else {
+      if (alloc_ == other.alloc_) {
+        swap_data(other);
+      } else {
+        Deque copy(alloc_);
+        for (T& value : other) {
+          copy.emplace_back(std::move(value));
         }
+        swap_data(copy);
       }
+    }
+    other.clear();
+    return *this;
+  }
+
+  Deque(size_t num, const T& value = T(), const Alloc& alloc = Alloc())
+      : num_columns_(((num >> RowShift) + 1) * 3),
+        head_row_index_(num_columns_ / 2),
+        tail_row_index_(num_columns_ / 2),
+        alloc_(alloc) {
+    reserve();
+    try {
+      append_n(num, repeat_iterator(value, 0));
     } catch (...) {
-      for (size_t i = 0; i < count; ++i) {
-        (*this)[i].~T();
-      }
-      for (size_t i = 0; i < num_columns_; ++i) {
-        delete[] reinterpret_cast<uint8_t*>(arr_[i]);
-      }
-      delete[] arr_;
+      free_storage();
       throw;
     }
   }
 
+  template <typename InputIt,
+            typename = typename std::iterator_traits<InputIt>::iterator_category>
+  Deque(InputIt first, InputIt last, const Alloc& alloc = Alloc()) : Deque(alloc) {
+    append(first, last);
+  }
+
+  void assign(size_t count, const T& value) {
+    T copy(value);
+    clear();
+    append_n(count, repeat_iterator(copy, 0));
+  }
+
+  template <typename InputIt,
+            typename = typename std::iterator_traits<InputIt>::iterator_category>
+  void assign(InputIt first, InputIt last) {
+    clear();
+    append(first, last);
+  }
+
+  template <typename Range>
+  void append_range(Range&& range) {
+    append(std::begin(range), std::end(range));
+  }
+
+  void resize(size_t count) {
+    if (count <= size_) {
+      erase(begin() + count, end());
+      return;
+    }
+    append_blocks(count - size_, [this](T* data, size_t n) { construct_default_block(data, n); });
+  }
+
+  void resize(size_t count, const T& value) {
+    if (count <= size_) {
+      erase(begin() + count, end());
+      return;
+    }
+    T copy(value);
+    append_n(count - size_, repeat_iterator(copy, 0));
+  }
+
+  Alloc get_allocator() const { return alloc_; }
+
   size_t size() const { return size_; }
 
+  // Calls f(data, count) for every contiguous block of elements, front to back.
+  template <typename F>
+  void for_each_segment(F f) {
+    iterator::walk_segments(begin(), end(), [&f](T* data, size_t count) {
+      f(data, count);
+      return false;
+    });
+  }
+
+  template <typename F>
+  void for_each_segment(F f) const {
+    const_iterator::walk_segments(begin(), end(), [&f](const T* data, size_t count) {
+      f(data, count);
+      return false;
+    });
+  }
+
   T& operator[](size_t index) {
-    return arr_[head_row_index_ + (head_column_index_ + index) / RowSize]
-               [(head_column_index_ + index) % RowSize];
+    return arr_[head_row_index_ + ((head_column_index_ + index) >> RowShift)]
+               [(head_column_index_ + index) & RowMask];
   }
 
   const T& operator[](size_t index) const {
-    return arr_[head_row_index_ + (head_column_index_ + index) / RowSize]
-               [(head_column_index_ + index) % RowSize];
+    return arr_[head_row_index_ + ((head_column_index_ + index) >> RowShift)]
+               [(head_column_index_ + index) & RowMask];
   }
 
   T& at(size_t index) {
@@ -331,134 +1150,630 @@ class Deque {
     return (*this)[index];
   }
 
-  void reallocate() {
-    T** new_deque = new T*[num_columns_ * 3];
-    size_t i;
-    try {
-        for (i = 0; i < num_columns_ * 3; ++i) {
-            if (i < num_columns_ || i >= 2 * num_columns_) {
-                new_deque[i] = reinterpret_cast<T*>(new uint8_t[sizeof(T) * RowSize]);
-            } else {
-                new_deque[i] = arr_[i - num_columns_];
-            }
-        }
-    } catch(...) {
-        for (size_t j = 0; j < i; ++j) {
-            if (j < num_columns_ || j >= 2 * num_columns_) {
-                delete[] reinterpret_cast<uint8_t*>(new_deque[j]);
-            }
-        }
-        delete[] new_deque;
-        throw;
-    }
+  T& front() { return (*this)[0]; }
 
-    delete[] arr_;
+  const T& front() const { return (*this)[0]; }
 
-    arr_ = new_deque;
-    head_row_index_ += num_columns_;
-    tail_row_index_ += num_columns_;
-    num_columns_ *= 3;
-  }
+  T& back() { return (*this)[size_ - 1]; }
+
+  const T& back() const { return (*this)[size_ - 1]; }
 
-  void push_back(const T& value) {
-    new (arr_[tail_row_index_] + tail_column_index_) T(value);
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    if (tail_column_index_ + 1 == RowSize || arr_[tail_row_index_] == nullptr) {
+      reallocate(0, 1);
+      ensure_blocks(tail_row_index_, tail_row_index_ + 2);
+    }
+    T* place = arr_[tail_row_index_] + tail_column_index_;
+    AllocTraits::construct(alloc_, place, std::forward<Args>(args)...);
     if (tail_column_index_ + 1 == RowSize) {
-      if (tail_row_index_ + 1 == num_columns_) {
-        try {
-            reallocate();
-        } catch(...) {
-            arr_[tail_row_index_][tail_column_index_].~T();
-            throw;
-        }
-      }
       ++tail_row_index_;
       tail_column_index_ = 0;
     } else {
       ++tail_column_index_;
     }
     ++size_;
+    return *place;
   }
 
-  void push_front(const T& value) {
-    if (head_column_index_!= 0 || head_row_index_ != 0) {
-        new (arr_[head_row_index_ - (head_column_index_ == 0)] + (head_column_index_ + RowSize - 1) % RowSize) T(value);
-        if (head_column_index_ == 0) {
-            --head_row_index_;
-            head_column_index_ = RowSize - 1;
-        } else {
-            --head_column_index_;
-        }
-    } else {
-        Deque copy = *this;
-        reallocate();
-        try {
-            new (arr_[head_row_index_ - 1] + RowSize - 1) T(value);
-            --head_row_index_;
-            head_column_index_ = RowSize - 1;
-        } catch(...) {
-            swap(copy);
-            throw;
-        }
+  template <typename... Args>
+  T& emplace_front(Args&&... args) {
+    if (head_column_index_ == 0) {
+      reallocate(1, 0);
+      ensure_blocks(head_row_index_ - 1, head_row_index_ + 1);
     }
+    size_t row = head_row_index_ - (head_column_index_ == 0);
+    size_t column = (head_column_index_ - 1) & RowMask;
+    AllocTraits::construct(alloc_, arr_[row] + column, std::forward<Args>(args)...);
+    head_row_index_ = row;
+    head_column_index_ = column;
     ++size_;
+    return arr_[row][column];
   }
 
+  void push_back(const T& value) { emplace_back(value); }
+
+  void push_back(T&& value) { emplace_back(std::move(value)); }
+
+  void push_front(const T& value) { emplace_front(value); }
+
+  void push_front(T&& value) { emplace_front(std::move(value)); }
+
   void pop_back() {
     if (tail_column_index_ == 0) {
+      release_blocks(tail_row_index_, tail_row_index_ + 1);
       --tail_row_index_;
       tail_column_index_ = RowSize - 1;
     } else {
         --tail_column_index_;
     }
-    arr_[tail_row_index_][tail_column_index_].~T();
+    AllocTraits::destroy(alloc_, arr_[tail_row_index_] + tail_column_index_);
     --size_;
+    if (tail_column_index_ == RowSize - 1) {
+      auto_shrink();
+    }
   }
 
   void pop_front() {
-    arr_[head_row_index_][head_column_index_].~T();
+    AllocTraits::destroy(alloc_, arr_[head_row_index_] + head_column_index_);
     if (head_column_index_ + 1 == RowSize) {
+      release_blocks(head_row_index_, head_row_index_ + 1);
       ++head_row_index_;
       head_column_index_ = 0;
     } else {
         ++head_column_index_;
     }
     --size_;
+    if (head_column_index_ == 0) {
+      auto_shrink();
+    }
+  }
+
+  template <typename... Args>
+  iterator emplace(iterator it, Args&&... args) {
+    size_t index = it - begin();
+    if (index == 0) {
+      emplace_front(std::forward<Args>(args)...);
+      return begin();
+    }
+    if (index == size_) {
+      emplace_back(std::forward<Args>(args)...);
+      return end() - 1;
+    }
+    T value(std::forward<Args>(args)...);
+    if (index < size_ - index) {
+      emplace_front(std::move(front()));
+      move_segments(begin() + 2, begin() + index + 1, begin() + 1);
+    } else {
+      emplace_back(std::move(back()));
+      move_segments_backward(begin() + index, end() - 2, end() - 1);
+    }
+    (*this)[index] = std::move(value);
+    return begin() + index;
   }
 
-  void insert(iterator it, const T& value) {
-    Deque<T> copy = *this;
+  iterator insert(iterator it, const T& value) { return emplace(it, value); }
+
+  iterator insert(iterator it, T&& value) { return emplace(it, std::move(value)); }
+
+  iterator insert(iterator it, size_t count, const T& value) {
+    size_t index = it - begin();
+    T copy(value);
+    insert_range(index, count, repeat_iterator(copy, 0));
+    return begin() + index;
+  }
+
+  template <typename InputIt,
+            typename = typename std::iterator_traits<InputIt>::iterator_category>
+  iterator insert(iterator it, InputIt first, InputIt last) {
+    size_t index = it - begin();
+    using category = typename std::iterator_traits<InputIt>::iterator_category;
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, category>) {
+      insert_range(index, std::distance(first, last), first);
+    } else {
+      Deque buffer(alloc_);
+      for (; first != last; ++first) {
+        buffer.emplace_back(*first);
+      }
+      insert_range(index, buffer.size(), std::make_move_iterator(buffer.begin()));
+    }
+    return begin() + index;
+  }
+
+  iterator erase(iterator it) { return erase(it, it + 1); }
+
+  iterator erase(iterator first, iterator last) {
+    size_t index = first - begin();
+    size_t count = last - first;
+    if (count == 0) {
+      return first;
+    }
+    if (index < size_ - index - count) {
+      move_segments_backward(begin(), first, last);
+      destroy_range(begin(), begin() + count);
+      size_t old_head_row = head_row_index_;
+      set_head_position(head_position() + count);
+      release_blocks(old_head_row, head_row_index_);
+    } else {
+      move_segments(last, end(), first);
+      destroy_range(end() - count, end());
+      size_t old_tail_row = tail_row_index_;
+      set_tail_position(tail_position() - count);
+      release_blocks(tail_row_index_ + 1, old_tail_row + 1);
+    }
+    size_ -= count;
+    auto_shrink();
+    return begin() + index;
+  }
+
+  void clear() {
+    destroy_range(begin(), end());
+    release_blocks(head_row_index_ + 1, tail_row_index_ + 1);
+    tail_row_index_ = head_row_index_;
+    tail_column_index_ = head_column_index_;
+    size_ = 0;
+    auto_shrink();
+  }
+
+  // Returns every block that holds no elements, including the spare cache,
+  // and moves the used rows into a map trimmed to fit them. Non-binding, like
+  // std::deque::shrink_to_fit: a failed map allocation is not reported.
+  void shrink_to_fit() {
+    for (size_t i = 0; i < spare_count_; ++i) {
+      deallocate_block(spare_blocks_[i]);
+    }
+    spare_count_ = 0;
+    trim_map();
+  }
+
+  // Makes pop_front/pop_back/erase/clear trim the map and free unused blocks
+  // once fewer than occupancy * capacity elements are left. The spare block
+  // cache is kept. Note that, unlike with std::deque, a trim invalidates
+  // every iterator, including those to elements that are still alive, at
+  // points that are hard to predict; references stay valid. Zero, the
+  // default, disables the policy.
+  void set_shrink_threshold(double occupancy) {
+    shrink_threshold_ = occupancy;
+    auto_shrink();
+  }
+
+  ~Deque() {
+    destroy_range(begin(), end());
+    free_storage();
+  }
+};
+
+const size_t CacheLineBytes = 64;
+
+// A Chase-Lev work-stealing deque laid out like Deque: elements live in
+// RowSize blocks reached through a power-of-two map of rows, indexed by
+// monotonically growing top/bottom counters. The owner thread pushes and
+// pops at the bottom; any thread may steal from the top.
+//
+// Growth never copies elements. The owner builds a map twice as large that
+// takes over every old block at the same logical row and adds fresh ones,
+// so a thief still reading through the old map sees the same memory. Old
+// maps are retired to a list and freed, with all blocks, by the destructor,
+// which must not run concurrently with other calls. Elements are atomics,
+// so T has to be trivially copyable.
+template <typename T, typename Alloc = std::allocator<T>,
+          size_t RowSize = deque_row_size<T>()>
+class StealingDeque {
+ private:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "StealingDeque elements must be trivially copyable");
+  static_assert(RowSize > 0 && (RowSize & (RowSize - 1)) == 0,
+                "StealingDeque row size must be a power of two");
+
+  using Cell = std::atomic<T>;
+
+  struct Map {
+    size_t mask;
+    Cell** rows;
+    Map* retired;
+  };
+
+  using AllocTraits = std::allocator_traits<Alloc>;
+  using CellAlloc = typename AllocTraits::template rebind_alloc<Cell>;
+  using RowsAlloc = typename AllocTraits::template rebind_alloc<Cell*>;
+  using MapAlloc = typename AllocTraits::template rebind_alloc<Map>;
+
+  static const size_t RowShift = deque_log2(RowSize);
+  static const size_t RowMask = RowSize - 1;
+  static const size_t InitialRows = 2;
+
+  // Thieves CAS top_ and the owner writes bottom_ on every push and pop, so
+  // each gets its own cache line; the rarely written map gets a third.
+  alignas(CacheLineBytes) std::atomic<int64_t> top_{0};
+  alignas(CacheLineBytes) std::atomic<int64_t> bottom_{0};
+  alignas(CacheLineBytes) std::atomic<Map*> map_;
+  Alloc alloc_;
+
+  static Cell& cell(Map* map, int64_t index) {
+    return map->rows[static_cast<size_t>(index >> RowShift) & map->mask]
+                    [static_cast<size_t>(index) & RowMask];
+  }
+
+  Cell* allocate_block() {
+    CellAlloc cell_alloc(alloc_);
+    Cell* block = std::allocator_traits<CellAlloc>::allocate(cell_alloc, RowSize);
+    for (size_t i = 0; i < RowSize; ++i) {
+      new (block + i) Cell();
+    }
+    return block;
+  }
+
+  void deallocate_block(Cell* block) {
+    CellAlloc cell_alloc(alloc_);
+    std::allocator_traits<CellAlloc>::deallocate(cell_alloc, block, RowSize);
+  }
+
+  Map* allocate_map(size_t rows) {
+    MapAlloc map_alloc(alloc_);
+    RowsAlloc rows_alloc(alloc_);
+    Map* map = std::allocator_traits<MapAlloc>::allocate(map_alloc, 1);
     try {
-      T tmp = value;
-      for (; it != end(); ++it) {
-        std::swap(*it, tmp);
+      map->rows = std::allocator_traits<RowsAlloc>::allocate(rows_alloc, rows);
+    } catch (...) {
+      std::allocator_traits<MapAlloc>::deallocate(map_alloc, map, 1);
+      throw;
+    }
+    map->mask = rows - 1;
+    map->retired = nullptr;
+    return map;
+  }
+
+  void deallocate_map(Map* map) {
+    MapAlloc map_alloc(alloc_);
+    RowsAlloc rows_alloc(alloc_);
+    std::allocator_traits<RowsAlloc>::deallocate(rows_alloc, map->rows, map->mask + 1);
+    std::allocator_traits<MapAlloc>::deallocate(map_alloc, map, 1);
+  }
+
+  // Fills count rows of map, starting at from and wrapping around, with
+  // fresh blocks; all or nothing.
+  void fill_rows(Map* map, size_t from, size_t count) {
+    size_t done = 0;
+    try {
+      for (; done < count; ++done) {
+        map->rows[(from + done) & map->mask] = allocate_block();
       }
-      push_back(tmp);
     } catch (...) {
-      swap(copy);
+      while (done > 0) {
+        --done;
+        deallocate_block(map->rows[(from + done) & map->mask]);
+      }
       throw;
     }
   }
 
-  void erase(iterator it) {
-    Deque<T> copy = *this;
+  // Called by the owner when the row of bottom would land on the block that
+  // still holds top. The live rows keep their blocks; the rest are new.
+  Map* grow(Map* old, int64_t top) {
+    size_t old_rows = old->mask + 1;
+    Map* map = allocate_map(old_rows * 2);
+    size_t first_row = static_cast<size_t>(top >> RowShift);
     try {
-      for (; it + 1 != end(); ++it) {
-        std::swap(*it, *(it + 1));
+      fill_rows(map, first_row + old_rows, old_rows);
+    } catch (...) {
+      deallocate_map(map);
+      throw;
+    }
+    for (size_t i = 0; i < old_rows; ++i) {
+      size_t row = first_row + i;
+      map->rows[row & map->mask] = old->rows[row & old->mask];
+    }
+    map->retired = old;
+    map_.store(map, std::memory_order_release);
+    return map;
+  }
+
+ public:
+  explicit StealingDeque(const Alloc& alloc = Alloc()) : alloc_(alloc) {
+    Map* map = allocate_map(InitialRows);
+    try {
+      fill_rows(map, 0, InitialRows);
+    } catch (...) {
+      deallocate_map(map);
+      throw;
+    }
+    map_.store(map, std::memory_order_relaxed);
+  }
+
+  StealingDeque(const StealingDeque&) = delete;
+  StealingDeque& operator=(const StealingDeque&) = delete;
+
+  // Owner only.
+  void push(const T& value) {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_acquire);
+    Map* map = map_.load(std::memory_order_relaxed);
+    if ((bottom >> RowShift) - (top >> RowShift) > static_cast<int64_t>(map->mask)) {
+      map = grow(map, top);
+    }
+    cell(map, bottom).store(value, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only. Takes the most recently pushed element.
+  bool pop(T& value) {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Map* map = map_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return false;
+    }
+    value = cell(map, bottom).load(std::memory_order_relaxed);
+    if (top == bottom) {
+      bool won = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed);
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Any thread. Takes the oldest element; fails when the deque is empty or
+  // another thread took that element first, so callers may retry or move on
+  // to another victim.
+  bool steal(T& value) {
+    int64_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) {
+      return false;
+    }
+    Map* map = map_.load(std::memory_order_acquire);
+    T result = cell(map, top).load(std::memory_order_relaxed);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return false;
+    }
+    value = result;
+    return true;
+  }
+
+  // A snapshot that may be stale by the time it is returned.
+  size_t size() const {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_relaxed);
+    return bottom > top ? static_cast<size_t>(bottom - top) : 0;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  ~StealingDeque() {
+    Map* map = map_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= map->mask; ++i) {
+      deallocate_block(map->rows[i]);
+    }
+    while (map != nullptr) {
+      Map* retired = map->retired;
+      deallocate_map(map);
+      map = retired;
+    }
+  }
+};
+
+// A bounded single-producer/single-consumer FIFO on Deque's block storage:
+// a power-of-two map of RowSize blocks, indexed by free-running head and
+// tail counters. The producer owns tail and the consumer owns head. Each
+// counter sits on its own cache line next to the owner's cached copy of the
+// other one, so a side rereads the shared counter only when its cached view
+// says the ring is full (or empty). The class is cache-line aligned, which
+// also pads the consumer's line away from neighbouring objects. Batched
+// calls move whole block runs at a time and publish the counter once per
+// batch.
+template <typename T, typename Alloc = std::allocator<T>,
+          size_t RowSize = deque_row_size<T>()>
+class SpscRing {
+ private:
+  static_assert(RowSize > 0 && (RowSize & (RowSize - 1)) == 0,
+                "SpscRing row size must be a power of two");
+
+  using AllocTraits = std::allocator_traits<Alloc>;
+  using MapAlloc = typename AllocTraits::template rebind_alloc<T*>;
+
+  static const size_t RowShift = deque_log2(RowSize);
+  static const size_t RowMask = RowSize - 1;
+
+  static constexpr bool BitwiseCopy =
+      std::is_trivially_copyable_v<T> && std::is_same_v<Alloc, std::allocator<T>>;
+
+  T** arr_ = nullptr;
+  size_t row_mask_ = 0;
+  size_t capacity_ = 0;
+  Alloc alloc_;
+
+  alignas(CacheLineBytes) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0;
+
+  alignas(CacheLineBytes) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+
+  T* slot(size_t index) const {
+    return arr_[(index >> RowShift) & row_mask_] + (index & RowMask);
+  }
+
+  // The number of elements from index to the end of its block, at most count.
+  static size_t run_length(size_t index, size_t count) {
+    return std::min(count, RowSize - (index & RowMask));
+  }
+
+  void free_storage() {
+    for (size_t i = 0; i <= row_mask_; ++i) {
+      if (arr_[i] != nullptr) {
+        AllocTraits::deallocate(alloc_, arr_[i], RowSize);
+      }
+    }
+    MapAlloc map_alloc(alloc_);
+    std::allocator_traits<MapAlloc>::deallocate(map_alloc, arr_, row_mask_ + 1);
+  }
+
+  void construct_run(T* to, const T* from, size_t count) {
+    if constexpr (BitwiseCopy) {
+      std::memcpy(static_cast<void*>(to), from, count * sizeof(T));
+    } else {
+      size_t done = 0;
+      try {
+        for (; done < count; ++done) {
+          AllocTraits::construct(alloc_, to + done, from[done]);
+        }
+      } catch (...) {
+        while (done > 0) {
+          AllocTraits::destroy(alloc_, to + --done);
+        }
+        throw;
+      }
+    }
+  }
+
+ public:
+  // Rounds capacity up to a power-of-two number of whole blocks.
+  explicit SpscRing(size_t capacity, const Alloc& alloc = Alloc()) : alloc_(alloc) {
+    size_t rows = 1;
+    while (rows * RowSize < capacity) {
+      rows *= 2;
+    }
+    MapAlloc map_alloc(alloc_);
+    arr_ = std::allocator_traits<MapAlloc>::allocate(map_alloc, rows);
+    std::fill(arr_, arr_ + rows, nullptr);
+    row_mask_ = rows - 1;
+    capacity_ = rows * RowSize;
+    try {
+      for (size_t i = 0; i < rows; ++i) {
+        arr_[i] = AllocTraits::allocate(alloc_, RowSize);
       }
-      pop_back();
     } catch (...) {
-      swap(copy);
+      free_storage();
       throw;
     }
   }
 
-  ~Deque() {
-    for (size_t i = 0; i < size(); ++i) {
-      (*this)[i].~T();
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  // Producer only.
+  template <typename... Args>
+  bool try_emplace(Args&&... args) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == capacity_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ == capacity_) {
+        return false;
+      }
     }
-    for (size_t i = 0; i < num_columns_; ++i) {
-      delete[] reinterpret_cast<uint8_t*>(arr_[i]);
+    AllocTraits::construct(alloc_, slot(tail), std::forward<Args>(args)...);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_push(const T& value) {
+    return try_emplace(value);
+  }
+
+  bool try_push(T&& value) {
+    return try_emplace(std::move(value));
+  }
+
+  // Producer only. Copies as many of values[0, count) as fit and returns
+  // how many that was.
+  size_t try_push_n(const T* values, size_t count) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (capacity_ - (tail - cached_head_) < count) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+    }
+    count = std::min(count, capacity_ - (tail - cached_head_));
+    size_t done = 0;
+    try {
+      while (done < count) {
+        size_t run = run_length(tail + done, count - done);
+        construct_run(slot(tail + done), values + done, run);
+        done += run;
+      }
+    } catch (...) {
+      tail_.store(tail + done, std::memory_order_release);
+      throw;
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer only.
+  bool try_pop(T& value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return false;
+      }
+    }
+    T* from = slot(head);
+    value = std::move(*from);
+    AllocTraits::destroy(alloc_, from);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Moves up to count elements into out and returns how many
+  // there were.
+  size_t try_pop_n(T* out, size_t count) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (cached_tail_ - head < count) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    }
+    count = std::min(count, cached_tail_ - head);
+    if constexpr (BitwiseCopy) {
+      size_t done = 0;
+      while (done < count) {
+        size_t run = run_length(head + done, count - done);
+        std::memcpy(static_cast<void*>(out + done), slot(head + done), run * sizeof(T));
+        done += run;
+      }
+    } else {
+      size_t done = 0;
+      try {
+        for (; done < count; ++done) {
+          T* from = slot(head + done);
+          out[done] = std::move(*from);
+          AllocTraits::destroy(alloc_, from);
+        }
+      } catch (...) {
+        head_.store(head + done, std::memory_order_release);
+        throw;
+      }
+    }
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  // Exact from either side when the other one is idle, a snapshot otherwise.
+  size_t size() const {
+    size_t head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  ~SpscRing() {
+    if constexpr (!BitwiseCopy) {
+      size_t tail = tail_.load(std::memory_order_relaxed);
+      for (size_t i = head_.load(std::memory_order_relaxed); i != tail; ++i) {
+        AllocTraits::destroy(alloc_, slot(i));
+      }
     }
-    delete[] arr_;
+    free_storage();
   }
 };
@@ -0,0 +1,94 @@
+// Element access cost of Deque for a small and a large element type:
+// sequential and random operator[], and an iterator scan.
+//
+//   g++ -std=c++17 -O2 deque_index_bench.cpp
+//
+// Reports nanoseconds per element access. Sizes can be scaled with the
+// optional argument (elements of the small type; the large type uses 1/16).
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "deque.hpp"
+
+namespace {
+
+struct Large {
+  uint64_t words[32];
+};
+
+uint64_t key(uint64_t value) { return value; }
+
+uint64_t key(const Large& value) { return value.words[0] ^ value.words[31]; }
+
+template <typename T>
+T make(size_t i) {
+  if constexpr (std::is_same_v<T, Large>) {
+    Large value{};
+    value.words[0] = i;
+    value.words[31] = i * 7;
+    return value;
+  } else {
+    return static_cast<T>(i);
+  }
+}
+
+template <typename F>
+double time_ns(size_t accesses, F body) {
+  auto start = std::chrono::steady_clock::now();
+  body();
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / static_cast<double>(accesses);
+}
+
+template <typename T>
+void run(const char* name, size_t count, int rounds) {
+  Deque<T> deque;
+  for (size_t i = 0; i < count; ++i) {
+    deque.push_back(make<T>(i));
+  }
+  std::vector<size_t> order(count);
+  std::mt19937_64 rng(1);
+  for (size_t& index : order) {
+    index = rng() % count;
+  }
+
+  uint64_t sink = 0;
+  size_t accesses = count * rounds;
+  double sequential = time_ns(accesses, [&] {
+    for (int r = 0; r < rounds; ++r) {
+      for (size_t i = 0; i < count; ++i) {
+        sink += key(deque[i]);
+      }
+    }
+  });
+  double random = time_ns(accesses, [&] {
+    for (int r = 0; r < rounds; ++r) {
+      for (size_t index : order) {
+        sink += key(deque[index]);
+      }
+    }
+  });
+  double scan = time_ns(accesses, [&] {
+    for (int r = 0; r < rounds; ++r) {
+      for (const T& value : deque) {
+        sink += key(value);
+      }
+    }
+  });
+  std::printf("%-18s %8zu elements  seq[] %6.2f  rand[] %6.2f  iter %6.2f ns  (%llu)\n",
+              name, count, sequential, random, scan, static_cast<unsigned long long>(sink));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4 << 20;
+  run<uint64_t>("uint64_t", count, 10);
+  run<Large>("256-byte struct", count / 16, 10);
+  return 0;
+}
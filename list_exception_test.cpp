@@ -0,0 +1,105 @@
+// Checks that List stays valid when the callback of sort, merge, remove_if
+// or unique throws part-way.
+//
+//   g++ -std=c++17 -g -fsanitize=address,undefined list_exception_test.cpp
+//
+// After each exception both lists must have a consistent ring (forward and
+// backward walks agree with size()), must not have lost or gained elements
+// where none are destroyed, and must be destructible.
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "stackallocator.cpp"
+
+namespace {
+
+struct Thrower {
+    int budget;
+
+    void operator()() {
+        if (budget-- == 0) {
+            throw std::runtime_error("callback");
+        }
+    }
+};
+
+bool walk(List<int>& list, std::vector<int>& out) {
+    std::vector<int> backward;
+    out.clear();
+    for (int value : list) {
+        out.push_back(value);
+    }
+    for (auto it = list.end(); it != list.begin();) {
+        --it;
+        backward.push_back(*it);
+    }
+    std::reverse(backward.begin(), backward.end());
+    return out == backward && out.size() == list.size();
+}
+
+bool check(const char* name, int op, std::mt19937& rng) {
+    for (int trial = 0; trial < 1000; ++trial) {
+        int count = static_cast<int>(rng() % 60) + 2;
+        Thrower thrower{static_cast<int>(rng() % (2 * count))};
+        std::vector<int> left(count);
+        std::vector<int> right(count);
+        for (int i = 0; i < count; ++i) {
+            left[i] = static_cast<int>(rng() % 20);
+            right[i] = static_cast<int>(rng() % 20);
+        }
+        if (op == 1) {
+            std::sort(left.begin(), left.end());
+            std::sort(right.begin(), right.end());
+        }
+        List<int> list(left.begin(), left.end());
+        List<int> other(right.begin(), right.end());
+        try {
+            if (op == 0) {
+                list.sort([&thrower](int a, int b) { thrower(); return a < b; });
+            } else if (op == 1) {
+                list.merge(other, [&thrower](int a, int b) { thrower(); return a < b; });
+            } else if (op == 2) {
+                list.remove_if([&thrower](int a) { thrower(); return a % 2 == 0; });
+            } else {
+                list.unique([&thrower](int a, int b) { thrower(); return a == b; });
+            }
+        } catch (const std::runtime_error&) {
+        }
+        std::vector<int> got;
+        std::vector<int> got_other;
+        if (!walk(list, got) || !walk(other, got_other)) {
+            std::printf("%s: broken ring after trial %d\n", name, trial);
+            return false;
+        }
+        if (op <= 1) {
+            std::vector<int> all = got;
+            all.insert(all.end(), got_other.begin(), got_other.end());
+            std::vector<int> expected = left;
+            expected.insert(expected.end(), right.begin(), right.end());
+            std::sort(all.begin(), all.end());
+            std::sort(expected.begin(), expected.end());
+            if (all != expected) {
+                std::printf("%s: elements lost after trial %d\n", name, trial);
+                return false;
+            }
+        }
+    }
+    std::printf("%s: ok\n", name);
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    std::mt19937 rng(1);
+    bool ok = true;
+    ok &= check("sort", 0, rng);
+    ok &= check("merge", 1, rng);
+    ok &= check("remove_if", 2, rng);
+    ok &= check("unique", 3, rng);
+    return ok ? 0 : 1;
+}
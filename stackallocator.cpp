@@ -1,4 +1,21 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <memory_resource>
+#include <new>
+#include <tuple>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+#ifndef MIPT_CONDITIONAL
+#define MIPT_CONDITIONAL
 
 template <bool B, typename T, typename F>
 struct conditional {
@@ -13,62 +30,585 @@ struct conditional<true, T, F> {
 template <bool B, typename T, typename F>
 using conditional_t = typename conditional<B, T, F>::type;
 
+#endif
+
+// Where a StackStorage gets more memory once its inline buffer is used up.
+class StackUpstream {
+public:
+    virtual uint8_t* allocate_chunk(size_t num, size_t align) = 0;
+    virtual void deallocate_chunk(uint8_t* ptr, size_t num, size_t align) = 0;
+protected:
+    ~StackUpstream() = default;
+};
+
+class HeapUpstream: public StackUpstream {
+public:
+    uint8_t* allocate_chunk(size_t num, size_t align) override {
+        return static_cast<uint8_t*>(::operator new(num, std::align_val_t(align)));
+    }
+
+    void deallocate_chunk(uint8_t* ptr, size_t num, size_t align) override {
+        ::operator delete(ptr, num, std::align_val_t(align));
+    }
+};
+
+inline StackUpstream& heap_upstream() {
+    static HeapUpstream upstream;
+    return upstream;
+}
+
+// Hands out memory from an inline N-byte buffer. When that runs out it
+// chains chunks taken from an upstream, each twice the size of the
+// previous one. A StackStorage can itself be the upstream of a smaller one.
+template<size_t N>
+class alignas(max_align_t) StackStorage: public StackUpstream {
+public:
+    // Any part of a block may be freed on its own, as a block of its own.
+    static constexpr bool partial_free = true;
+
+private:
+    struct alignas(max_align_t) Chunk {
+        Chunk* prev;
+        size_t size;
+        size_t used_before;
+    };
+
+    alignas(max_align_t) uint8_t memory[N];
+    uint8_t* base = memory;
+    size_t limit = N;
+    size_t filled = 0;
+    Chunk* chunk = nullptr;
+    size_t used_before = 0;
+    size_t chunk_capacity = 0;
+    size_t next_chunk_size = N < 256 ? 256 : N;
+    StackUpstream* upstream;
+
+    static size_t padding(const uint8_t* ptr, size_t align) {
+        return (align - reinterpret_cast<uintptr_t>(ptr) % align) % align;
+    }
+
+    void add_chunk(size_t num, size_t align) {
+        size_t size = std::max(next_chunk_size, sizeof(Chunk) + num + align);
+        uint8_t* raw = upstream->allocate_chunk(size, alignof(Chunk));
+        chunk = new (raw) Chunk{chunk, size, used_before + filled};
+        chunk_capacity += size - sizeof(Chunk);
+        base = reinterpret_cast<uint8_t*>(chunk + 1);
+        limit = size - sizeof(Chunk);
+        filled = 0;
+        used_before = chunk->used_before;
+        next_chunk_size = size * 2;
+    }
+
+    void pop_chunk() {
+        Chunk* prev = chunk->prev;
+        chunk_capacity -= chunk->size - sizeof(Chunk);
+        next_chunk_size = chunk->size;
+        upstream->deallocate_chunk(reinterpret_cast<uint8_t*>(chunk), chunk->size, alignof(Chunk));
+        chunk = prev;
+        base = chunk ? reinterpret_cast<uint8_t*>(chunk + 1) : memory;
+        limit = chunk ? chunk->size - sizeof(Chunk) : N;
+        used_before = chunk ? chunk->used_before : 0;
+    }
+
+public:
+    // A saved position of the bump pointer.
+    class Marker {
+        friend class StackStorage;
+    private:
+        Chunk* chunk;
+        size_t filled;
+        Marker(Chunk* chunk, size_t filled): chunk(chunk), filled(filled) {}
+    };
+
+    // Rolls the storage back to where it was on construction, freeing
+    // everything allocated in between at once. Nothing allocated inside the
+    // scope may be used or deallocated after it ends.
+    class Scope {
+    private:
+        StackStorage& storage;
+        Marker marker;
+    public:
+        explicit Scope(StackStorage& storage): storage(storage), marker(storage.mark()) {}
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope() {
+            storage.release(marker);
+        }
+    };
+
+    explicit StackStorage(StackUpstream& upstream = heap_upstream()): upstream(&upstream) {}
+    StackStorage(const StackStorage&) = delete;
+    StackStorage& operator=(const StackStorage&) = delete;
+
+    ~StackStorage() {
+        while (chunk != nullptr) {
+            pop_chunk();
+        }
+    }
+
+    uint8_t* get_memory(size_t num, size_t align) {
+        size_t pos = filled + padding(base + filled, align);
+        if (pos > limit || num > limit - pos) {
+            add_chunk(num, align);
+            pos = padding(base, align);
+        }
+        filled = pos + num;
+        return base + pos;
+    }
+
+    // Only the most recent allocation is given back; anything else stays
+    // in use until a Scope around it ends.
+    void free_memory(uint8_t* ptr, size_t num, size_t) {
+        if (ptr + num == base + filled) {
+            filled = ptr - base;
+        }
+    }
+
+    Marker mark() const {
+        return Marker(chunk, filled);
+    }
+
+    void release(Marker marker) {
+        while (chunk != marker.chunk) {
+            pop_chunk();
+        }
+        filled = marker.filled;
+    }
+
+    // Bytes handed out so far, alignment padding included.
+    size_t used() const {
+        return used_before + filled;
+    }
+
+    // Bytes available without asking the upstream for more.
+    size_t capacity() const {
+        return N + chunk_capacity;
+    }
+
+    uint8_t* allocate_chunk(size_t num, size_t align) override {
+        return get_memory(num, align);
+    }
+
+    void deallocate_chunk(uint8_t* ptr, size_t num, size_t align) override {
+        free_memory(ptr, num, align);
+    }
+};
+
+// A StackStorage that many threads may allocate from at once: the bump
+// pointer is advanced with one fetch_add. Sizes are rounded up to
+// max_align_t, which keeps every block aligned without a CAS loop. Requests
+// that are over-aligned or do not fit go to the upstream, which must be
+// thread-safe itself (the heap is).
 template<size_t N>
-class alignas(max_align_t) StackStorage {
+class alignas(max_align_t) AtomicStackStorage {
+public:
+    // A block that spilled to the upstream has to be freed whole.
+    static constexpr bool partial_free = false;
+
+private:
+    static constexpr size_t Step = alignof(max_align_t);
+
+    alignas(max_align_t) uint8_t memory[N];
+    std::atomic<size_t> filled{0};
+    StackUpstream* upstream;
+
+    static size_t round_up(size_t num) {
+        return (num + Step - 1) / Step * Step;
+    }
+
+    bool owns(const uint8_t* ptr) const {
+        return std::less_equal<const uint8_t*>()(memory, ptr) && std::less<const uint8_t*>()(ptr, memory + N);
+    }
+
+public:
+    explicit AtomicStackStorage(StackUpstream& upstream = heap_upstream()): upstream(&upstream) {}
+    AtomicStackStorage(const AtomicStackStorage&) = delete;
+    AtomicStackStorage& operator=(const AtomicStackStorage&) = delete;
+
+    uint8_t* get_memory(size_t num, size_t align) {
+        if (align <= Step && num <= N) {
+            size_t size = round_up(num);
+            size_t pos = filled.fetch_add(size, std::memory_order_acquire);
+            if (size <= N && pos <= N - size) {
+                return memory + pos;
+            }
+        }
+        return upstream->allocate_chunk(num, std::max(align, Step));
+    }
+
+    // Takes the bump pointer back if ptr is still the most recent block. The
+    // release pairs with the acquire in get_memory of the next thread to be
+    // handed the same bytes.
+    void free_memory(uint8_t* ptr, size_t num, size_t align) {
+        if (!owns(ptr)) {
+            upstream->deallocate_chunk(ptr, num, std::max(align, Step));
+            return;
+        }
+        size_t end = ptr - memory + round_up(num);
+        filled.compare_exchange_strong(end, ptr - memory, std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    size_t used() const {
+        return std::min(filled.load(std::memory_order_relaxed), N);
+    }
+
+    size_t capacity() const {
+        return N;
+    }
+};
+
+// A single thread's view of a shared thread-safe storage: it takes
+// ChunkSize-byte chunks from the shared storage and bump-allocates inside
+// them without any synchronisation. Each thread owns its own arena, for
+// example a thread_local one. Chunks are handed back when the arena is
+// destroyed.
+template<typename Shared, size_t ChunkSize = 64 * 1024>
+class ThreadStackArena {
+public:
+    // Whether a block went to the shared storage depends on its size, so
+    // its parts would be freed to the wrong place.
+    static constexpr bool partial_free = false;
+
+private:
+    struct alignas(max_align_t) Chunk {
+        Chunk* prev;
+    };
+
+    static constexpr size_t Usable = ChunkSize - sizeof(Chunk);
+
+    Shared& shared;
+    Chunk* chunk = nullptr;
+    uint8_t* base = nullptr;
+    size_t filled = 0;
+
+    static size_t padding(const uint8_t* ptr, size_t align) {
+        return (align - reinterpret_cast<uintptr_t>(ptr) % align) % align;
+    }
+
+    static bool direct(size_t num, size_t align) {
+        return num > Usable / 4 || align > alignof(max_align_t);
+    }
+
+    void add_chunk() {
+        uint8_t* raw = shared.get_memory(ChunkSize, alignof(Chunk));
+        chunk = new (raw) Chunk{chunk};
+        base = reinterpret_cast<uint8_t*>(chunk + 1);
+        filled = 0;
+    }
+
+public:
+    explicit ThreadStackArena(Shared& shared): shared(shared) {}
+    ThreadStackArena(const ThreadStackArena&) = delete;
+    ThreadStackArena& operator=(const ThreadStackArena&) = delete;
+
+    ~ThreadStackArena() {
+        while (chunk != nullptr) {
+            Chunk* prev = chunk->prev;
+            shared.free_memory(reinterpret_cast<uint8_t*>(chunk), ChunkSize, alignof(Chunk));
+            chunk = prev;
+        }
+    }
+
+    uint8_t* get_memory(size_t num, size_t align) {
+        if (direct(num, align)) {
+            return shared.get_memory(num, align);
+        }
+        size_t pos = chunk == nullptr ? Usable + 1 : filled + padding(base + filled, align);
+        if (pos > Usable || num > Usable - pos) {
+            add_chunk();
+            pos = 0;
+        }
+        filled = pos + num;
+        return base + pos;
+    }
+
+    // Blocks inside the chunks are only reclaimed in LIFO order.
+    void free_memory(uint8_t* ptr, size_t num, size_t align) {
+        if (direct(num, align)) {
+            shared.free_memory(ptr, num, align);
+        } else if (ptr + num == base + filled) {
+            filled = ptr - base;
+        }
+    }
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// A stack storage whose capacity is chosen at run time. The whole range is
+// reserved as inaccessible address space up front, and committed in
+// CommitStep pieces as the bump pointer reaches it, so a multi-GiB arena
+// costs nothing until it is used. With huge_pages the mapping is first
+// tried with MAP_HUGETLB; if the huge page pool cannot back it, it falls
+// back to ordinary pages aligned for, and advised as, transparent huge
+// pages. Running out of the reservation throws std::bad_alloc.
+class MappedStackStorage {
+public:
+    static constexpr bool partial_free = true;
+
 private:
-    uint8_t memory[N];
+    static const size_t CommitStep = size_t(2) << 20;
+
+    uint8_t* region = nullptr;
+    size_t region_size = 0;
+    uint8_t* memory = nullptr;
+    size_t reserved = 0;
+    size_t committed = 0;
     size_t filled = 0;
+    bool huge = false;
+
+    static size_t round_up(size_t num, size_t step) {
+        return (num + step - 1) / step * step;
+    }
+
+    void map(size_t capacity, bool huge_pages) {
+        reserved = round_up(capacity, CommitStep);
+#ifdef MAP_HUGETLB
+        // No MAP_NORESERVE here: without it the mapping fails up front,
+        // instead of faulting later, when the huge page pool is too small.
+        if (huge_pages) {
+            void* ptr = mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (ptr != MAP_FAILED) {
+                region = memory = static_cast<uint8_t*>(ptr);
+                region_size = reserved;
+                huge = true;
+                return;
+            }
+        }
+#endif
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+#endif
+        region_size = huge_pages ? reserved + CommitStep : reserved;
+        void* ptr = mmap(nullptr, region_size, PROT_NONE, flags, -1, 0);
+        if (ptr == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        region = memory = static_cast<uint8_t*>(ptr);
+        if (huge_pages) {
+            memory += (CommitStep - reinterpret_cast<uintptr_t>(region) % CommitStep) % CommitStep;
+#ifdef MADV_HUGEPAGE
+            madvise(memory, reserved, MADV_HUGEPAGE);
+#endif
+        }
+    }
+
+    void commit(size_t end) {
+        size_t new_committed = std::min(round_up(end, CommitStep), reserved);
+        if (mprotect(memory + committed, new_committed - committed, PROT_READ | PROT_WRITE) != 0) {
+            throw std::bad_alloc();
+        }
+        committed = new_committed;
+    }
+
 public:
-    StackStorage() = default;
+    explicit MappedStackStorage(size_t capacity, bool huge_pages = false) {
+        map(capacity, huge_pages);
+    }
+
+    MappedStackStorage(const MappedStackStorage&) = delete;
+    MappedStackStorage& operator=(const MappedStackStorage&) = delete;
+
+    ~MappedStackStorage() {
+        munmap(region, region_size);
+    }
+
     uint8_t* get_memory(size_t num, size_t align) {
-        size_t pos = filled + (align - (filled % align)) % align;
+        size_t pos = filled + (align - reinterpret_cast<uintptr_t>(memory + filled) % align) % align;
+        if (pos > reserved || num > reserved - pos) {
+            throw std::bad_alloc();
+        }
+        if (pos + num > committed) {
+            commit(pos + num);
+        }
         filled = pos + num;
         return memory + pos;
     }
+
+    void free_memory(uint8_t* ptr, size_t num, size_t) {
+        if (ptr + num == memory + filled) {
+            filled = ptr - memory;
+        }
+    }
+
+    size_t used() const {
+        return filled;
+    }
+
+    size_t capacity() const {
+        return reserved;
+    }
+
+    // Whether the mapping got explicit (MAP_HUGETLB) huge pages.
+    bool huge_pages() const {
+        return huge;
+    }
+};
+
+#endif
+
+// Recycles freed blocks through one free list per size class, so node-based
+// containers churning on top of a Storage (a StackStorage, say) keep a
+// stable footprint. Classes are ClassStep bytes apart up to MaxPooled;
+// larger or over-aligned requests go straight to the storage. Freed blocks
+// stay in the lists until the pool is destroyed, so the pool must not
+// outlive a Scope of the storage it allocates in.
+template<typename Storage>
+class StackPool {
+public:
+    // Freed blocks go to the list of their size class, so a piece of a
+    // bigger block must not be freed on its own.
+    static constexpr bool partial_free = false;
+
+private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    static const size_t ClassStep = alignof(max_align_t);
+    static const size_t MaxPooled = 512;
+    static const size_t Classes = MaxPooled / ClassStep;
+
+    Storage& storage;
+    FreeSlot* free_lists[Classes] = {};
+
+    static bool pooled(size_t num, size_t align) {
+        return num <= MaxPooled && align <= ClassStep;
+    }
+
+    static size_t size_class(size_t num) {
+        return num == 0 ? 0 : (num - 1) / ClassStep;
+    }
+
+public:
+    explicit StackPool(Storage& storage): storage(storage) {}
+    StackPool(const StackPool&) = delete;
+    StackPool& operator=(const StackPool&) = delete;
+
+    uint8_t* get_memory(size_t num, size_t align) {
+        if (!pooled(num, align)) {
+            return storage.get_memory(num, align);
+        }
+        size_t index = size_class(num);
+        if (FreeSlot* slot = free_lists[index]) {
+            free_lists[index] = slot->next;
+            return reinterpret_cast<uint8_t*>(slot);
+        }
+        return storage.get_memory((index + 1) * ClassStep, ClassStep);
+    }
+
+    void free_memory(uint8_t* ptr, size_t num, size_t align) {
+        if (!pooled(num, align)) {
+            storage.free_memory(ptr, num, align);
+            return;
+        }
+        size_t index = size_class(num);
+        free_lists[index] = new (ptr) FreeSlot{free_lists[index]};
+    }
+};
+
+// Exposes a Storage as a std::pmr::memory_resource, so containers built on
+// std::pmr::polymorphic_allocator can use stack storages of any size, and
+// mix with the standard pmr resources, without changing type.
+template<typename Storage>
+class StackMemoryResource: public std::pmr::memory_resource {
+private:
+    Storage& storage;
+
+public:
+    explicit StackMemoryResource(Storage& storage): storage(storage) {}
+
+protected:
+    void* do_allocate(size_t num, size_t align) override {
+        return storage.get_memory(num, align);
+    }
+
+    void do_deallocate(void* ptr, size_t num, size_t align) override {
+        storage.free_memory(static_cast<uint8_t*>(ptr), num, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
 };
 
-template<typename T, size_t N>
+template<typename T, size_t N, typename Storage = StackStorage<N>>
 class StackAllocator {
 private:
-    StackStorage<N>* ptr;
+    Storage* ptr;
 public:
     using value_type = T;
+    // Allocators are equal when they share a storage. A container moves or
+    // swaps its allocator along with its nodes, so those stay O(1) even
+    // between different storages; copies keep their own storage.
+    using is_always_equal = std::false_type;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    // Whether deallocate(p + i, 1) may be used on part of an allocate(n).
+    static constexpr bool partial_deallocation = Storage::partial_free;
 
     StackAllocator() = delete;
     StackAllocator(const StackAllocator& other) = default;
     StackAllocator& operator= (const StackAllocator& other) = default;
     ~StackAllocator() = default;
 
-    template<typename F, size_t M>
+    template<typename F, size_t M, typename S>
     friend class StackAllocator;
 
-    explicit StackAllocator(StackStorage<N>& ptr): ptr(&ptr){}
+    explicit StackAllocator(Storage& ptr): ptr(&ptr){}
 
     template<typename F>
-    StackAllocator(const StackAllocator<F, N>& other): ptr(other.ptr) {}
+    StackAllocator(const StackAllocator<F, N, Storage>& other): ptr(other.ptr) {}
 
     template<typename F>
     struct rebind {
-        using other = StackAllocator<F, N>;
+        using other = StackAllocator<F, N, Storage>;
     };
 
     value_type* allocate(size_t num) {
         return reinterpret_cast<value_type*>(ptr->get_memory(num * sizeof(value_type), alignof(value_type)));
     }
 
-    void deallocate(T*, size_t) {}
+    void deallocate(T* ptr_to_free, size_t num) {
+        ptr->free_memory(reinterpret_cast<uint8_t*>(ptr_to_free), num * sizeof(value_type), alignof(value_type));
+    }
+
+    template<typename F>
+    bool operator==(const StackAllocator<F, N, Storage>& other) const {
+        return ptr == other.ptr;
+    }
+
+    template<typename F>
+    bool operator!=(const StackAllocator<F, N, Storage>& other) const {
+        return ptr != other.ptr;
+    }
+};
 
+// The links shared by the nodes of List, UnrolledList, IntrusiveList and
+// LruCache. Each keeps a BaseNode as the sentinel that closes the ring.
+struct ListBaseNode {
+    ListBaseNode* prev;
+    ListBaseNode* next;
+    ListBaseNode() = default;
+    ListBaseNode(ListBaseNode* prev, ListBaseNode* next): prev(prev), next(next) {}
 };
 
+// Exchanges the nodes hanging off two sentinels; empty rings are fine.
+inline void swap_list_rings(ListBaseNode& left, ListBaseNode& right) {
+    auto left_prev = left.prev;
+    auto right_prev = right.prev;
+    auto left_next = left.next;
+    auto right_next = right.next;
+    std::swap(right_prev->next, left_prev->next);
+    std::swap(right_next->prev, left_next->prev);
+    std::swap(left, right);
+}
+
 template<typename T, typename Alloc = std::allocator<T>>
 class List {
 private:
-    struct BaseNode {
-        BaseNode* prev;
-        BaseNode* next;
-        BaseNode() = default;
-        BaseNode(BaseNode* prev, BaseNode* next): prev(prev), next(next) {}
-    };
+    using BaseNode = ListBaseNode;
 
     struct Node: public BaseNode {
         T value_;
@@ -148,20 +688,194 @@ private:
         }
     };
 
+    static const size_t MinChurn = 64;
+
     BaseNode head_ = BaseNode(&head_, &head_);
     size_t size_ = 0;
+    size_t churn_ = 0;
+    double compact_threshold_ = 0;
     Alloc alloc_;
 
-    void swap(List& other) {
-        auto this_prev = head_.prev;
-        auto other_prev = other.head_.prev;
-        auto this_next = head_.next;
-        auto other_next = other.head_.next;
-        std::swap(other_prev->next, this_prev->next);
-        std::swap(other_next->prev, this_next->prev);
-        std::swap(head_, other.head_);
+    // Exchanges the elements and the churn that describes their layout. The
+    // compaction policy stays with the list it was set on.
+    void swap_nodes(List& other) {
+        swap_list_rings(head_, other.head_);
         std::swap(size_, other.size_);
-        std::swap(alloc_, other.alloc_);
+        std::swap(churn_, other.churn_);
+    }
+
+    void destroy_node(BaseNode* node) {
+        NodeAlloc nalloc(alloc_);
+        Node* todelete = static_cast<Node*>(node);
+        todelete->prev->next = todelete->next;
+        todelete->next->prev = todelete->prev;
+        std::allocator_traits<NodeAlloc>::destroy(nalloc, todelete);
+        std::allocator_traits<NodeAlloc>::deallocate(nalloc, todelete, 1);
+        --size_;
+    }
+
+    // The automatic compaction is best-effort, like Deque::trim_map: the
+    // element has already been inserted or erased, so a failed compaction
+    // is dropped and leaves the list as it was.
+    void note_churn() {
+        ++churn_;
+        if (compact_threshold_ > 0 && churn_ > MinChurn &&
+            static_cast<double>(churn_) > compact_threshold_ * static_cast<double>(size_)) {
+            try {
+                compact();
+            } catch (...) {
+            }
+        }
+    }
+
+    // Moves the nodes [first, last) in front of pos by relinking them.
+    static void transfer(BaseNode* pos, BaseNode* first, BaseNode* last) {
+        if (first == last || pos == last) {
+            return;
+        }
+        BaseNode* tail = last->prev;
+        first->prev->next = last;
+        last->prev = first->prev;
+        tail->next = pos;
+        first->prev = pos->prev;
+        pos->prev->next = first;
+        pos->prev = tail;
+    }
+
+    template<typename A, typename = void>
+    struct has_partial_deallocation : std::false_type {};
+
+    template<typename A>
+    struct has_partial_deallocation<A, std::enable_if_t<A::partial_deallocation>> : std::true_type {};
+
+    // Builds count nodes with make(nalloc, node) and links them in front of
+    // pos. When the allocator lets nodes be freed one by one out of a bigger
+    // allocation, all of them come from a single allocate(count), so they
+    // sit in memory in traversal order. Either way every node is allocated
+    // before make runs for the first one, and nothing is attached to the
+    // list if an allocation or a constructor throws.
+    template<typename Maker>
+    void insert_nodes(BaseNode* pos, size_t count, Maker make) {
+        if (count == 0) {
+            return;
+        }
+        using NodeTraits = std::allocator_traits<NodeAlloc>;
+        NodeAlloc nalloc(alloc_);
+        if constexpr (has_partial_deallocation<NodeAlloc>::value) {
+            Node* nodes = NodeTraits::allocate(nalloc, count);
+            size_t built = 0;
+            try {
+                for (; built < count; ++built) {
+                    make(nalloc, nodes + built);
+                    nodes[built].prev = built == 0 ? pos->prev : nodes + built - 1;
+                    nodes[built].next = nodes + built + 1;
+                }
+            } catch (...) {
+                for (size_t i = 0; i < built; ++i) {
+                    NodeTraits::destroy(nalloc, nodes + i);
+                }
+                NodeTraits::deallocate(nalloc, nodes, count);
+                throw;
+            }
+            nodes[count - 1].next = pos;
+            pos->prev->next = nodes;
+            pos->prev = nodes + count - 1;
+            size_ += count;
+        } else {
+            // The raw nodes are chained, in allocation order, through a
+            // BaseNode placed at their start until they are constructed.
+            BaseNode* raw = nullptr;
+            BaseNode** raw_tail = &raw;
+            auto free_raw = [&raw, &nalloc] {
+                while (raw != nullptr) {
+                    BaseNode* next = raw->next;
+                    NodeTraits::deallocate(nalloc, static_cast<Node*>(raw), 1);
+                    raw = next;
+                }
+            };
+            try {
+                for (size_t i = 0; i < count; ++i) {
+                    Node* node = NodeTraits::allocate(nalloc, 1);
+                    *raw_tail = new (static_cast<void*>(node)) BaseNode(nullptr, nullptr);
+                    raw_tail = &(*raw_tail)->next;
+                }
+            } catch (...) {
+                free_raw();
+                throw;
+            }
+            List built(alloc_);
+            while (raw != nullptr) {
+                Node* node = static_cast<Node*>(raw);
+                raw = raw->next;
+                try {
+                    make(nalloc, node);
+                } catch (...) {
+                    NodeTraits::deallocate(nalloc, node, 1);
+                    free_raw();
+                    throw;
+                }
+                node->prev = built.head_.prev;
+                node->next = &built.head_;
+                built.head_.prev->next = node;
+                built.head_.prev = node;
+                ++built.size_;
+            }
+            transfer(pos, built.head_.next, &built.head_);
+            size_ += built.size_;
+            built.size_ = 0;
+        }
+    }
+
+    void copy_nodes(const List& other) {
+        const BaseNode* from = other.head_.next;
+        insert_nodes(&head_, other.size_, [&from](NodeAlloc& nalloc, Node* node) {
+            std::allocator_traits<NodeAlloc>::construct(nalloc, node, static_cast<const Node*>(from)->value_);
+            from = from->next;
+        });
+    }
+
+    // Merges two null-terminated chains linked through next only into left
+    // and empties right. On ties nodes of left come first. If comp throws,
+    // left still ends up holding every node, in no particular order.
+    template<typename Compare>
+    static void merge_chains(BaseNode*& left, BaseNode*& right, Compare& comp) {
+        BaseNode merged;
+        BaseNode* tail = &merged;
+        try {
+            while (left != nullptr && right != nullptr) {
+                if (comp(static_cast<Node*>(right)->value_, static_cast<Node*>(left)->value_)) {
+                    tail->next = right;
+                    right = right->next;
+                } else {
+                    tail->next = left;
+                    left = left->next;
+                }
+                tail = tail->next;
+            }
+        } catch (...) {
+            tail->next = left;
+            while (tail->next != nullptr) {
+                tail = tail->next;
+            }
+            tail->next = right;
+            left = merged.next;
+            right = nullptr;
+            throw;
+        }
+        tail->next = left != nullptr ? left : right;
+        left = merged.next;
+        right = nullptr;
+    }
+
+    // Links a null-terminated chain after prev, setting the prev pointers,
+    // and returns its last node.
+    static BaseNode* link_chain(BaseNode* prev, BaseNode* chain) {
+        for (; chain != nullptr; chain = chain->next) {
+            prev->next = chain;
+            chain->prev = prev;
+            prev = chain;
+        }
+        return prev;
     }
 public:
     using iterator = common_iterator<false>;
@@ -217,58 +931,89 @@ public:
     explicit List(const Alloc& alloc = Alloc()): alloc_(alloc) {}
 
     List(size_t num, const T& value, const Alloc& alloc = Alloc()): alloc_(alloc) {
-        try {
-            for (size_t i = 0; i < num; ++i) {
-                emplace_back(value);
-            }
-        } catch(...) {
-            clear_list();
-            throw;
-        }
+        insert_nodes(&head_, num, [&value](NodeAlloc& nalloc, Node* node) {
+            std::allocator_traits<NodeAlloc>::construct(nalloc, node, value);
+        });
     }
 
     explicit List(size_t num, const Alloc& alloc = Alloc()) : List(alloc) {
-        try {
-            for (size_t i = 0; i < num; ++i) {
-                emplace_back();
-            }
-        } catch(...) {
-            clear_list();
-            throw;
-        }
+        insert_nodes(&head_, num, [](NodeAlloc& nalloc, Node* node) {
+            std::allocator_traits<NodeAlloc>::construct(nalloc, node);
+        });
     }
 
-    List (const List& other) : alloc_(std::allocator_traits<Alloc>::select_on_container_copy_construction(other.alloc_)) {
-        try {
-            for (const auto& el:other) {
-                push_back(el);
-            }
-        } catch (...) {
-            clear_list();
-            throw;
-        }
+    template<typename InputIt,
+             typename = typename std::iterator_traits<InputIt>::iterator_category>
+    List(InputIt first, InputIt last, const Alloc& alloc = Alloc()) : List(alloc) {
+        insert(end(), first, last);
+    }
+
+    List (const List& other)
+            : compact_threshold_(other.compact_threshold_),
+              alloc_(std::allocator_traits<Alloc>::select_on_container_copy_construction(other.alloc_)) {
+        copy_nodes(other);
     }
 
     List& operator=(const List& other) {
         Alloc alloc = std::allocator_traits<Alloc>::propagate_on_container_copy_assignment::value ? other.alloc_ : alloc_;
         List<T, Alloc> copy(alloc);
-        Node* ptr = static_cast<Node*>(other.head_.next);
-        for (size_t i = 0; i < other.size_; ++i) {
-            copy.push_back(ptr->value_);
-            if (i + 1 != other.size_) {
-                ptr = static_cast<Node*>(ptr->next);
-            }
+        copy.copy_nodes(other);
+        swap_nodes(copy);
+        compact_threshold_ = other.compact_threshold_;
+        if constexpr (std::allocator_traits<Alloc>::propagate_on_container_copy_assignment::value) {
+            std::swap(alloc_, copy.alloc_);
         }
-        swap(copy);
         return *this;
     }
 
-    template<typename ...Args>
-    void emplace_back(Args&&... args) {
-        emplace(end(), std::forward<Args>(args)...);
+    List(List&& other) noexcept
+            : compact_threshold_(other.compact_threshold_), alloc_(std::move(other.alloc_)) {
+        swap_nodes(other);
     }
 
-    template<typename ...Args>
+    // Relinks the nodes when the allocator moves along or compares equal;
+    // only unequal, non-propagating allocators fall back to moving elements.
+    List& operator=(List&& other) noexcept(
+            std::allocator_traits<Alloc>::propagate_on_container_move_assignment::value ||
+            std::allocator_traits<Alloc>::is_always_equal::value) {
+        if (this == &other) {
+            return *this;
+        }
+        if constexpr (std::allocator_traits<Alloc>::propagate_on_container_move_assignment::value) {
+            swap_nodes(other);
+            std::swap(alloc_, other.alloc_);
+        } else if constexpr (std::allocator_traits<Alloc>::is_always_equal::value) {
+            swap_nodes(other);
+        } else {
+            if (alloc_ == other.alloc_) {
+                swap_nodes(other);
+            } else {
+                List copy(alloc_);
+                for (auto& el : other) {
+                    copy.emplace_back(std::move(el));
+                }
+                swap_nodes(copy);
+            }
+        }
+        compact_threshold_ = other.compact_threshold_;
+        other.clear_list();
+        return *this;
+    }
+
+    void swap(List& other) noexcept {
+        swap_nodes(other);
+        std::swap(compact_threshold_, other.compact_threshold_);
+        if constexpr (std::allocator_traits<Alloc>::propagate_on_container_swap::value) {
+            std::swap(alloc_, other.alloc_);
+        }
+    }
+
+    template<typename ...Args>
+    void emplace_back(Args&&... args) {
+        emplace(end(), std::forward<Args>(args)...);
+    }
+
+    template<typename ...Args>
     void emplace(const_iterator iter, Args&&... args) {
         NodeAlloc nalloc(alloc_);
         Node* newnode = std::allocator_traits<NodeAlloc>::allocate(nalloc, 1);
@@ -283,6 +1028,7 @@ public:
         iter.ptr->prev->next = newnode;
         iter.ptr->prev = newnode;
         ++size_;
+        note_churn();
     }
 
 
@@ -306,14 +1052,291 @@ public:
         emplace(iter, value);
     }
 
+    iterator insert(const_iterator iter, size_t num, const T& value) {
+        BaseNode* before = iter.ptr->prev;
+        insert_nodes(iter.ptr, num, [&value](NodeAlloc& nalloc, Node* node) {
+            std::allocator_traits<NodeAlloc>::construct(nalloc, node, value);
+        });
+        return iterator(before->next);
+    }
+
+    template<typename InputIt,
+             typename = typename std::iterator_traits<InputIt>::iterator_category>
+    iterator insert(const_iterator iter, InputIt first, InputIt last) {
+        BaseNode* before = iter.ptr->prev;
+        using category = typename std::iterator_traits<InputIt>::iterator_category;
+        if constexpr (std::is_base_of_v<std::forward_iterator_tag, category>) {
+            insert_nodes(iter.ptr, std::distance(first, last), [&first](NodeAlloc& nalloc, Node* node) {
+                std::allocator_traits<NodeAlloc>::construct(nalloc, node, *first);
+                ++first;
+            });
+        } else {
+            List buffer(alloc_);
+            for (; first != last; ++first) {
+                buffer.emplace_back(*first);
+            }
+            transfer(iter.ptr, buffer.head_.next, &buffer.head_);
+            size_ += buffer.size_;
+            buffer.size_ = 0;
+        }
+        return iterator(before->next);
+    }
+
+    void assign(size_t num, const T& value) {
+        List copy(num, value, alloc_);
+        swap_nodes(copy);
+    }
+
+    template<typename InputIt,
+             typename = typename std::iterator_traits<InputIt>::iterator_category>
+    void assign(InputIt first, InputIt last) {
+        List copy(first, last, alloc_);
+        swap_nodes(copy);
+    }
+
     void erase(const_iterator iter) {
+        destroy_node(iter.ptr);
+        note_churn();
+    }
+
+    // Moves the elements into freshly allocated nodes laid out in traversal
+    // order (one allocation where insert_nodes can batch) and frees the old
+    // ones. Invalidates every iterator. All new nodes are allocated before
+    // any element is moved, and elements are only moved when that cannot
+    // throw, so if an allocation or a copy throws the list is left as it
+    // was. On StackStorage and MappedStackStorage the old nodes are not
+    // reclaimed (their frees are not LIFO), so every compaction grows the
+    // arena by size() nodes; keep that in mind for set_compact_threshold.
+    void compact() {
+        churn_ = 0;
+        if (size_ == 0) {
+            return;
+        }
+        List fresh(alloc_);
+        BaseNode* from = head_.next;
+        fresh.insert_nodes(&fresh.head_, size_, [&from](NodeAlloc& nalloc, Node* node) {
+            std::allocator_traits<NodeAlloc>::construct(
+                    nalloc, node, std::move_if_noexcept(static_cast<Node*>(from)->value_));
+            from = from->next;
+        });
+        BaseNode* old = head_.next;
+        swap_list_rings(head_, fresh.head_);
+        // The old nodes are freed in chain order without unlinking them one
+        // by one, which would touch both neighbours of every node.
         NodeAlloc nalloc(alloc_);
-        Node* todelete = static_cast<Node*>(iter.ptr);
-        todelete->prev->next = todelete->next;
-        todelete->next->prev = todelete->prev;
-        std::allocator_traits<NodeAlloc>::destroy(nalloc, todelete);
-        std::allocator_traits<NodeAlloc>::deallocate(nalloc, todelete, 1);
-        --size_;
+        while (old != &fresh.head_) {
+            Node* node = static_cast<Node*>(old);
+            old = old->next;
+            std::allocator_traits<NodeAlloc>::destroy(nalloc, node);
+            std::allocator_traits<NodeAlloc>::deallocate(nalloc, node, 1);
+        }
+        fresh.head_ = BaseNode(&fresh.head_, &fresh.head_);
+        fresh.size_ = 0;
+    }
+
+    // Makes emplace/erase call compact() once more than churn * size()
+    // (and at least MinChurn) of them have run since the last compaction.
+    // Note that this invalidates iterators at unpredictable points. Zero,
+    // the default, disables it.
+    void set_compact_threshold(double churn) {
+        compact_threshold_ = churn;
+    }
+
+    // The splice and merge overloads take nodes from other as they are, so
+    // both lists must have equal allocators.
+    void splice(const_iterator pos, List& other) {
+        transfer(pos.ptr, other.head_.next, &other.head_);
+        size_ += other.size_;
+        other.size_ = 0;
+    }
+
+    void splice(const_iterator pos, List&& other) {
+        splice(pos, other);
+    }
+
+    void splice(const_iterator pos, List& other, const_iterator it) {
+        if (pos.ptr == it.ptr || pos.ptr == it.ptr->next) {
+            return;
+        }
+        transfer(pos.ptr, it.ptr, it.ptr->next);
+        --other.size_;
+        ++size_;
+    }
+
+    void splice(const_iterator pos, List&& other, const_iterator it) {
+        splice(pos, other, it);
+    }
+
+    void splice(const_iterator pos, List& other, const_iterator first, const_iterator last) {
+        if (&other != this) {
+            size_t count = 0;
+            for (BaseNode* node = first.ptr; node != last.ptr; node = node->next) {
+                ++count;
+            }
+            other.size_ -= count;
+            size_ += count;
+        }
+        transfer(pos.ptr, first.ptr, last.ptr);
+    }
+
+    void splice(const_iterator pos, List&& other, const_iterator first, const_iterator last) {
+        splice(pos, other, first, last);
+    }
+
+    // Both lists must be sorted by comp; equal elements of other go after
+    // those of this list. Each run is counted as it is moved, so if comp
+    // throws both lists stay valid, with the elements moved so far in this
+    // one.
+    template<typename Compare>
+    void merge(List& other, Compare comp) {
+        if (&other == this) {
+            return;
+        }
+        BaseNode* pos = head_.next;
+        BaseNode* from = other.head_.next;
+        while (pos != &head_ && from != &other.head_) {
+            if (comp(static_cast<Node*>(from)->value_, static_cast<Node*>(pos)->value_)) {
+                BaseNode* run_end = from->next;
+                size_t run = 1;
+                while (run_end != &other.head_ &&
+                       comp(static_cast<Node*>(run_end)->value_, static_cast<Node*>(pos)->value_)) {
+                    run_end = run_end->next;
+                    ++run;
+                }
+                transfer(pos, from, run_end);
+                size_ += run;
+                other.size_ -= run;
+                from = run_end;
+            } else {
+                pos = pos->next;
+            }
+        }
+        transfer(&head_, from, &other.head_);
+        size_ += other.size_;
+        other.size_ = 0;
+    }
+
+    template<typename Compare>
+    void merge(List&& other, Compare comp) {
+        merge(other, comp);
+    }
+
+    void merge(List& other) {
+        merge(other, std::less<T>());
+    }
+
+    void merge(List&& other) {
+        merge(other, std::less<T>());
+    }
+
+    // Stable bottom-up merge sort: runs of 2^i nodes are kept in bins[i]
+    // and only the links are rewritten. If comp throws, every node is linked
+    // back into the ring, in unspecified order, before the exception leaves.
+    template<typename Compare>
+    void sort(Compare comp) {
+        if (size_ < 2) {
+            return;
+        }
+        BaseNode* bins[64] = {};
+        BaseNode* carry = nullptr;
+        BaseNode* sorted = nullptr;
+        head_.prev->next = nullptr;
+        BaseNode* node = head_.next;
+        try {
+            while (node != nullptr) {
+                carry = node;
+                node = node->next;
+                carry->next = nullptr;
+                size_t i = 0;
+                for (; bins[i] != nullptr; ++i) {
+                    merge_chains(bins[i], carry, comp);
+                    std::swap(carry, bins[i]);
+                }
+                bins[i] = carry;
+                carry = nullptr;
+            }
+            for (BaseNode*& bin : bins) {
+                if (bin != nullptr) {
+                    merge_chains(bin, sorted, comp);
+                    std::swap(sorted, bin);
+                }
+            }
+        } catch (...) {
+            BaseNode* prev = link_chain(&head_, node);
+            prev = link_chain(prev, carry);
+            prev = link_chain(prev, sorted);
+            for (BaseNode* bin : bins) {
+                prev = link_chain(prev, bin);
+            }
+            prev->next = &head_;
+            head_.prev = prev;
+            throw;
+        }
+        BaseNode* prev = link_chain(&head_, sorted);
+        prev->next = &head_;
+        head_.prev = prev;
+    }
+
+    void sort() {
+        sort(std::less<T>());
+    }
+
+    // The removing operations below collect the nodes into a local list
+    // first, so pred or value may refer to an element being removed. The
+    // sizes are kept in step with every transfer, so a throwing pred leaves
+    // both lists consistent; the nodes removed so far are destroyed.
+    template<typename Predicate>
+    size_t remove_if(Predicate pred) {
+        List removed(alloc_);
+        BaseNode* node = head_.next;
+        while (node != &head_) {
+            BaseNode* next = node->next;
+            if (pred(static_cast<Node*>(node)->value_)) {
+                transfer(&removed.head_, node, next);
+                ++removed.size_;
+                --size_;
+            }
+            node = next;
+        }
+        return removed.size_;
+    }
+
+    size_t remove(const T& value) {
+        return remove_if([&value](const T& el) { return el == value; });
+    }
+
+    template<typename BinaryPredicate>
+    size_t unique(BinaryPredicate pred) {
+        List removed(alloc_);
+        if (size_ == 0) {
+            return 0;
+        }
+        BaseNode* kept = head_.next;
+        BaseNode* node = kept->next;
+        while (node != &head_) {
+            BaseNode* next = node->next;
+            if (pred(static_cast<Node*>(kept)->value_, static_cast<Node*>(node)->value_)) {
+                transfer(&removed.head_, node, next);
+                ++removed.size_;
+                --size_;
+            } else {
+                kept = node;
+            }
+            node = next;
+        }
+        return removed.size_;
+    }
+
+    size_t unique() {
+        return unique(std::equal_to<T>());
+    }
+
+    void reverse() {
+        BaseNode* node = &head_;
+        do {
+            std::swap(node->prev, node->next);
+            node = node->prev;
+        } while (node != &head_);
     }
 
     size_t size() const {
@@ -326,7 +1349,7 @@ public:
 
     void clear_list() {
         while (size_) {
-            pop_back();
+            destroy_node(head_.prev);
         }
     }
 
@@ -334,3 +1357,848 @@ public:
         clear_list();
     }
 };
+
+struct DefaultListTag {};
+
+// Embeds the links of one IntrusiveList in an object; derive from several
+// hooks with different tags to put the object on several lists at once.
+// A copied hook starts unlinked, and a destroyed one unlinks itself.
+template<typename Tag = DefaultListTag>
+struct ListHook: public ListBaseNode {
+    ListHook(): ListBaseNode(nullptr, nullptr) {}
+
+    ListHook(const ListHook&): ListHook() {}
+
+    ListHook& operator=(const ListHook&) {
+        return *this;
+    }
+
+    bool is_linked() const {
+        return next != nullptr;
+    }
+
+    // Takes the object off whatever list holds it, in O(1).
+    void unlink() {
+        if (is_linked()) {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = nullptr;
+        }
+    }
+
+    ~ListHook() {
+        unlink();
+    }
+};
+
+// A list of objects that derive from ListHook<Tag>. It never allocates or
+// owns its elements: inserting links an object's hook into the ring,
+// erasing unlinks it. Since hooks can unlink themselves behind the list's
+// back, size() walks the ring.
+template<typename T, typename Tag = DefaultListTag>
+class IntrusiveList {
+private:
+    using BaseNode = ListBaseNode;
+    using Hook = ListHook<Tag>;
+
+    template<bool IsConst>
+    class common_iterator {
+        friend class IntrusiveList;
+    private:
+        BaseNode* ptr;
+
+    public:
+        using value_type = conditional_t<IsConst, const T, T>;
+        using difference_type = std::ptrdiff_t;
+        using iterator_category = std::bidirectional_iterator_tag;
+        using pointer = conditional_t<IsConst, const T*, T*>;
+        using reference = conditional_t<IsConst, const T&, T&>;
+
+        explicit common_iterator(const BaseNode* ptr) : ptr(const_cast<BaseNode*>(ptr)) {}
+
+        common_iterator(const common_iterator<false>& copy)
+                : ptr(copy.ptr) {}
+
+        common_iterator& operator=(const common_iterator& other) = default;
+
+        common_iterator& operator++() {
+            ptr = ptr->next;
+            return *this;
+        }
+
+        common_iterator& operator--() {
+            ptr = ptr->prev;
+            return *this;
+        }
+
+        common_iterator operator++(int) {
+            common_iterator copy = *this;
+            ++(*this);
+            return copy;
+        }
+
+        common_iterator operator--(int) {
+            common_iterator copy = *this;
+            --(*this);
+            return copy;
+        }
+
+        bool operator==(const common_iterator<IsConst>& other) const {
+            return ptr == other.ptr;
+        }
+
+        bool operator!=(const common_iterator<IsConst>& other) const {
+            return ptr != other.ptr;
+        }
+
+        reference operator*() const {
+            return static_cast<T&>(*static_cast<Hook*>(ptr));
+        }
+
+        pointer operator->() const {
+            return &**this;
+        }
+    };
+
+    BaseNode head_ = BaseNode(&head_, &head_);
+
+    static Hook* hook(T& value) {
+        return static_cast<Hook*>(&value);
+    }
+
+public:
+    using value_type = T;
+    using iterator = common_iterator<false>;
+    using const_iterator = common_iterator<true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    IntrusiveList() = default;
+
+    IntrusiveList(const IntrusiveList&) = delete;
+    IntrusiveList& operator=(const IntrusiveList&) = delete;
+
+    IntrusiveList(IntrusiveList&& other) noexcept {
+        swap_list_rings(head_, other.head_);
+    }
+
+    IntrusiveList& operator=(IntrusiveList&& other) noexcept {
+        if (this != &other) {
+            clear();
+            swap_list_rings(head_, other.head_);
+        }
+        return *this;
+    }
+
+    void swap(IntrusiveList& other) noexcept {
+        swap_list_rings(head_, other.head_);
+    }
+
+    // Links value before pos, first unlinking it from any list it is on.
+    iterator insert(const_iterator pos, T& value) {
+        Hook* node = hook(value);
+        BaseNode* next = pos.ptr == node ? node->next : pos.ptr;
+        node->unlink();
+        node->prev = next->prev;
+        node->next = next;
+        next->prev->next = node;
+        next->prev = node;
+        return iterator(node);
+    }
+
+    iterator erase(const_iterator pos) {
+        iterator next(pos.ptr->next);
+        static_cast<Hook*>(pos.ptr)->unlink();
+        return next;
+    }
+
+    void push_back(T& value) {
+        insert(end(), value);
+    }
+
+    void push_front(T& value) {
+        insert(begin(), value);
+    }
+
+    void pop_back() {
+        erase(--end());
+    }
+
+    void pop_front() {
+        erase(begin());
+    }
+
+    T& front() {
+        return *begin();
+    }
+
+    const T& front() const {
+        return *begin();
+    }
+
+    T& back() {
+        return *--end();
+    }
+
+    const T& back() const {
+        return *--end();
+    }
+
+    // The iterator of an object known to be on this list.
+    iterator iterator_to(T& value) {
+        return iterator(hook(value));
+    }
+
+    bool empty() const {
+        return head_.next == &head_;
+    }
+
+    size_t size() const {
+        size_t count = 0;
+        for (const BaseNode* node = head_.next; node != &head_; node = node->next) {
+            ++count;
+        }
+        return count;
+    }
+
+    void clear() {
+        while (!empty()) {
+            static_cast<Hook*>(head_.next)->unlink();
+        }
+    }
+
+    iterator begin() {
+        return iterator(head_.next);
+    }
+
+    const_iterator begin() const {
+        return const_iterator(head_.next);
+    }
+
+    const_iterator cbegin() const {
+        return const_iterator(head_.next);
+    }
+
+    iterator end() {
+        return iterator(&head_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(&head_);
+    }
+
+    const_iterator cend() const {
+        return const_iterator(&head_);
+    }
+
+    reverse_iterator rbegin() {
+        return reverse_iterator(end());
+    }
+
+    const_reverse_iterator rbegin() const {
+        return const_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rend() const {
+        return const_reverse_iterator(begin());
+    }
+
+    ~IntrusiveList() {
+        clear();
+    }
+};
+
+// A List that keeps up to Capacity elements, about a cache line's worth, in
+// every node. Nodes are split when an insert hits a full one and merged
+// with the next when an erase leaves them less than half full (only for
+// nothrow-movable T, so that erase cannot throw). Iterators
+// into a node that is split, merged or shifted by insert/erase become
+// invalid; those into other nodes stay valid.
+template<typename T, typename Alloc = std::allocator<T>>
+class UnrolledList {
+private:
+    using BaseNode = ListBaseNode;
+    using AllocTraits = std::allocator_traits<Alloc>;
+
+    static constexpr size_t Capacity = sizeof(T) * 2 > 64 ? 2 : 64 / sizeof(T);
+
+    struct Node: public BaseNode {
+        size_t count = 0;
+        alignas(T) unsigned char storage[Capacity * sizeof(T)];
+
+        T* data() {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+
+    using NodeAlloc = typename AllocTraits::template rebind_alloc<Node>;
+    using NodeTraits = std::allocator_traits<NodeAlloc>;
+
+    template<bool IsConst>
+    class common_iterator {
+        friend class UnrolledList;
+    private:
+        BaseNode* ptr;
+        size_t index;
+
+    public:
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using iterator_category = std::bidirectional_iterator_tag;
+        using pointer = conditional_t<IsConst, const T*, T*>;
+        using reference = conditional_t<IsConst, const T&, T&>;
+
+        common_iterator(const BaseNode* ptr, size_t index)
+                : ptr(const_cast<BaseNode*>(ptr)), index(index) {}
+
+        template<bool OtherConst, typename = std::enable_if_t<IsConst || !OtherConst>>
+        common_iterator(const common_iterator<OtherConst>& other)
+                : ptr(other.ptr), index(other.index) {}
+
+        template<bool OtherConst>
+        friend class common_iterator;
+
+        common_iterator& operator++() {
+            if (++index == static_cast<Node*>(ptr)->count) {
+                ptr = ptr->next;
+                index = 0;
+            }
+            return *this;
+        }
+
+        common_iterator& operator--() {
+            if (index == 0) {
+                ptr = ptr->prev;
+                index = static_cast<Node*>(ptr)->count;
+            }
+            --index;
+            return *this;
+        }
+
+        common_iterator operator++(int) {
+            common_iterator copy = *this;
+            ++(*this);
+            return copy;
+        }
+
+        common_iterator operator--(int) {
+            common_iterator copy = *this;
+            --(*this);
+            return copy;
+        }
+
+        template<bool OtherConst>
+        bool operator==(const common_iterator<OtherConst>& other) const {
+            return ptr == other.ptr && index == other.index;
+        }
+
+        template<bool OtherConst>
+        bool operator!=(const common_iterator<OtherConst>& other) const {
+            return !(*this == other);
+        }
+
+        reference operator*() const {
+            return static_cast<Node*>(ptr)->data()[index];
+        }
+
+        pointer operator->() const {
+            return static_cast<Node*>(ptr)->data() + index;
+        }
+    };
+
+    BaseNode head_ = BaseNode(&head_, &head_);
+    size_t size_ = 0;
+    Alloc alloc_;
+
+    Node* create_node(BaseNode* next) {
+        NodeAlloc nalloc(alloc_);
+        Node* node = NodeTraits::allocate(nalloc, 1);
+        new (node) Node();
+        node->next = next;
+        node->prev = next->prev;
+        next->prev->next = node;
+        next->prev = node;
+        return node;
+    }
+
+    void destroy_node(Node* node) {
+        for (size_t i = 0; i < node->count; ++i) {
+            AllocTraits::destroy(alloc_, node->data() + i);
+        }
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->~Node();
+        NodeAlloc nalloc(alloc_);
+        NodeTraits::deallocate(nalloc, node, 1);
+    }
+
+    // Move-constructs from[first, count) onto the end of to, then destroys
+    // the sources.
+    void move_tail(Node* from, size_t first, Node* to) {
+        T* src = from->data();
+        T* dst = to->data() + to->count;
+        for (size_t i = first; i < from->count; ++i) {
+            AllocTraits::construct(alloc_, dst++, std::move_if_noexcept(src[i]));
+            ++to->count;
+        }
+        for (size_t i = first; i < from->count; ++i) {
+            AllocTraits::destroy(alloc_, src + i);
+        }
+        from->count = first;
+    }
+
+    bool is_node(const BaseNode* ptr) const {
+        return ptr != &head_;
+    }
+
+    void swap_nodes(UnrolledList& other) {
+        swap_list_rings(head_, other.head_);
+        std::swap(size_, other.size_);
+    }
+
+public:
+    using iterator = common_iterator<false>;
+    using const_iterator = common_iterator<true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    iterator begin() {
+        return iterator(head_.next, 0);
+    }
+
+    iterator end() {
+        return iterator(&head_, 0);
+    }
+
+    const_iterator begin() const {
+        return const_iterator(head_.next, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(&head_, 0);
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    const_iterator cend() const {
+        return end();
+    }
+
+    reverse_iterator rbegin() {
+        return std::make_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return std::make_reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rbegin() const {
+        return std::make_reverse_iterator(cend());
+    }
+
+    const_reverse_iterator rend() const {
+        return std::make_reverse_iterator(cbegin());
+    }
+
+    explicit UnrolledList(const Alloc& alloc = Alloc()): alloc_(alloc) {}
+
+    UnrolledList(size_t num, const T& value, const Alloc& alloc = Alloc()): alloc_(alloc) {
+        try {
+            for (size_t i = 0; i < num; ++i) {
+                emplace_back(value);
+            }
+        } catch(...) {
+            clear();
+            throw;
+        }
+    }
+
+    UnrolledList(const UnrolledList& other)
+            : alloc_(AllocTraits::select_on_container_copy_construction(other.alloc_)) {
+        try {
+            for (const auto& el : other) {
+                emplace_back(el);
+            }
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    UnrolledList(UnrolledList&& other) noexcept : alloc_(std::move(other.alloc_)) {
+        swap_nodes(other);
+    }
+
+    UnrolledList& operator=(const UnrolledList& other) {
+        UnrolledList copy(AllocTraits::propagate_on_container_copy_assignment::value ? other.alloc_ : alloc_);
+        for (const auto& el : other) {
+            copy.emplace_back(el);
+        }
+        swap_nodes(copy);
+        if constexpr (AllocTraits::propagate_on_container_copy_assignment::value) {
+            std::swap(alloc_, copy.alloc_);
+        }
+        return *this;
+    }
+
+    UnrolledList& operator=(UnrolledList&& other) noexcept(
+            AllocTraits::propagate_on_container_move_assignment::value ||
+            AllocTraits::is_always_equal::value) {
+        if (this == &other) {
+            return *this;
+        }
+        if constexpr (AllocTraits::propagate_on_container_move_assignment::value) {
+            swap_nodes(other);
+            std::swap(alloc_, other.alloc_);
+        } else if constexpr (AllocTraits::is_always_equal::value) {
+            swap_nodes(other);
+        } else {
+            if (alloc_ == other.alloc_) {
+                swap_nodes(other);
+            } else {
+                UnrolledList copy(alloc_);
+                for (auto& el : other) {
+                    copy.emplace_back(std::move(el));
+                }
+                swap_nodes(copy);
+            }
+        }
+        other.clear();
+        return *this;
+    }
+
+    void swap(UnrolledList& other) noexcept {
+        swap_nodes(other);
+        if constexpr (AllocTraits::propagate_on_container_swap::value) {
+            std::swap(alloc_, other.alloc_);
+        }
+    }
+
+    template<typename ...Args>
+    iterator emplace(const_iterator iter, Args&&... args) {
+        Node* node = static_cast<Node*>(iter.ptr);
+        size_t index = iter.index;
+        if (index == 0 && is_node(iter.ptr->prev) &&
+                static_cast<Node*>(iter.ptr->prev)->count < Capacity) {
+            node = static_cast<Node*>(iter.ptr->prev);
+            index = node->count;
+        } else if (!is_node(iter.ptr)) {
+            node = create_node(&head_);
+        } else if (node->count == Capacity) {
+            Node* half = create_node(node->next);
+            try {
+                move_tail(node, Capacity / 2, half);
+            } catch (...) {
+                destroy_node(half);
+                throw;
+            }
+            if (index > Capacity / 2) {
+                node = half;
+                index -= Capacity / 2;
+            }
+        }
+        T* data = node->data();
+        if (index == node->count) {
+            try {
+                AllocTraits::construct(alloc_, data + index, std::forward<Args>(args)...);
+            } catch (...) {
+                if (node->count == 0) {
+                    destroy_node(node);
+                }
+                throw;
+            }
+        } else {
+            T value(std::forward<Args>(args)...);
+            AllocTraits::construct(alloc_, data + node->count, std::move(data[node->count - 1]));
+            std::move_backward(data + index, data + node->count - 1, data + node->count);
+            data[index] = std::move(value);
+        }
+        ++node->count;
+        ++size_;
+        return iterator(node, index);
+    }
+
+    template<typename ...Args>
+    void emplace_back(Args&&... args) {
+        emplace(end(), std::forward<Args>(args)...);
+    }
+
+    void push_back(const T& value) {
+        emplace_back(value);
+    }
+
+    void push_front(const T& value) {
+        emplace(begin(), value);
+    }
+
+    void insert(const_iterator iter, const T& value) {
+        emplace(iter, value);
+    }
+
+    iterator erase(const_iterator iter) {
+        Node* node = static_cast<Node*>(iter.ptr);
+        size_t index = iter.index;
+        T* data = node->data();
+        std::move(data + index + 1, data + node->count, data + index);
+        AllocTraits::destroy(alloc_, data + node->count - 1);
+        --node->count;
+        --size_;
+        if (node->count == 0) {
+            BaseNode* next = node->next;
+            destroy_node(node);
+            return iterator(next, 0);
+        }
+        if (std::is_nothrow_move_constructible_v<T> && node->count < Capacity / 2 && is_node(node->next)) {
+            Node* next = static_cast<Node*>(node->next);
+            if (node->count + next->count <= Capacity) {
+                move_tail(next, 0, node);
+                destroy_node(next);
+            }
+        }
+        if (index < node->count) {
+            return iterator(node, index);
+        }
+        return iterator(node->next, 0);
+    }
+
+    void pop_back() {
+        erase(--end());
+    }
+
+    void pop_front() {
+        erase(begin());
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    Alloc get_allocator() const {
+        return alloc_;
+    }
+
+    void clear() {
+        while (is_node(head_.next)) {
+            destroy_node(static_cast<Node*>(head_.next));
+        }
+        size_ = 0;
+    }
+
+    ~UnrolledList() {
+        clear();
+    }
+};
+
+// A fixed-capacity LRU map. Entries are ListBaseNodes on a recency ring
+// (front = most recent) and are chained into a hash index of
+// power-of-two size. All entries and buckets are allocated once, in the
+// constructor, so lookups, hits and evictions never allocate: a hit
+// relinks its entry to the front, and a put into a full cache reuses the
+// least recent entry in place. A capacity of zero is treated as one.
+template<typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>,
+         typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+class LruCache {
+public:
+    using value_type = std::pair<const K, V>;
+
+private:
+    using AllocTraits = std::allocator_traits<Alloc>;
+
+    struct Entry: public ListBaseNode {
+        Entry* chain;
+        size_t hash;
+        alignas(value_type) unsigned char storage[sizeof(value_type)];
+
+        value_type* item() {
+            return std::launder(reinterpret_cast<value_type*>(storage));
+        }
+    };
+
+    using EntryAlloc = typename AllocTraits::template rebind_alloc<Entry>;
+    using BucketAlloc = typename AllocTraits::template rebind_alloc<Entry*>;
+
+    ListBaseNode head_ = ListBaseNode(&head_, &head_);
+    Entry* entries_ = nullptr;
+    Entry** buckets_ = nullptr;
+    Entry* free_ = nullptr;
+    size_t capacity_;
+    size_t mask_;
+    size_t size_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t evictions_ = 0;
+    Alloc alloc_;
+    Hash hash_;
+    KeyEqual equal_;
+
+    static size_t bucket_count(size_t capacity) {
+        size_t count = 1;
+        while (count < capacity) {
+            count *= 2;
+        }
+        return count;
+    }
+
+    static void unlink(ListBaseNode* node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+    }
+
+    void link_front(ListBaseNode* node) {
+        node->prev = &head_;
+        node->next = head_.next;
+        head_.next->prev = node;
+        head_.next = node;
+    }
+
+    Entry** find_slot(const K& key, size_t hash) {
+        Entry** slot = buckets_ + (hash & mask_);
+        while (*slot != nullptr &&
+               ((*slot)->hash != hash || !equal_((*slot)->item()->first, key))) {
+            slot = &(*slot)->chain;
+        }
+        return slot;
+    }
+
+    // Drops the entry from the index and the ring and destroys its item.
+    void release(Entry* entry) {
+        Entry** slot = buckets_ + (entry->hash & mask_);
+        while (*slot != entry) {
+            slot = &(*slot)->chain;
+        }
+        *slot = entry->chain;
+        unlink(entry);
+        AllocTraits::destroy(alloc_, entry->item());
+        --size_;
+    }
+
+public:
+    explicit LruCache(size_t capacity, const Alloc& alloc = Alloc())
+            : capacity_(std::max<size_t>(capacity, 1)), mask_(bucket_count(capacity_) - 1),
+              alloc_(alloc) {
+        EntryAlloc ealloc(alloc_);
+        BucketAlloc balloc(alloc_);
+        entries_ = std::allocator_traits<EntryAlloc>::allocate(ealloc, capacity_);
+        try {
+            buckets_ = std::allocator_traits<BucketAlloc>::allocate(balloc, mask_ + 1);
+        } catch (...) {
+            std::allocator_traits<EntryAlloc>::deallocate(ealloc, entries_, capacity_);
+            throw;
+        }
+        std::fill(buckets_, buckets_ + mask_ + 1, nullptr);
+        for (size_t i = capacity_; i > 0; --i) {
+            Entry* entry = new (entries_ + i - 1) Entry();
+            entry->chain = free_;
+            free_ = entry;
+        }
+    }
+
+    LruCache(const LruCache&) = delete;
+    LruCache& operator=(const LruCache&) = delete;
+
+    ~LruCache() {
+        clear();
+        EntryAlloc ealloc(alloc_);
+        BucketAlloc balloc(alloc_);
+        std::allocator_traits<BucketAlloc>::deallocate(balloc, buckets_, mask_ + 1);
+        std::allocator_traits<EntryAlloc>::deallocate(ealloc, entries_, capacity_);
+    }
+
+    // Returns the value for key and makes it the most recent, or nullptr.
+    V* get(const K& key) {
+        Entry* entry = *find_slot(key, hash_(key));
+        if (entry == nullptr) {
+            ++misses_;
+            return nullptr;
+        }
+        ++hits_;
+        unlink(entry);
+        link_front(entry);
+        return &entry->item()->second;
+    }
+
+    // Stores V(args...) under key as the most recent entry, evicting the
+    // least recent one when the cache is full.
+    template<typename... Args>
+    V& put(const K& key, Args&&... args) {
+        size_t hash = hash_(key);
+        Entry** slot = find_slot(key, hash);
+        if (*slot != nullptr) {
+            Entry* entry = *slot;
+            entry->item()->second = V(std::forward<Args>(args)...);
+            unlink(entry);
+            link_front(entry);
+            return entry->item()->second;
+        }
+        Entry* entry = free_;
+        if (entry != nullptr) {
+            free_ = entry->chain;
+        } else {
+            entry = static_cast<Entry*>(head_.prev);
+            release(entry);
+            ++evictions_;
+            slot = find_slot(key, hash);
+        }
+        try {
+            AllocTraits::construct(alloc_, entry->item(), std::piecewise_construct,
+                                   std::forward_as_tuple(key),
+                                   std::forward_as_tuple(std::forward<Args>(args)...));
+        } catch (...) {
+            entry->chain = free_;
+            free_ = entry;
+            throw;
+        }
+        entry->hash = hash;
+        entry->chain = nullptr;
+        *slot = entry;
+        link_front(entry);
+        ++size_;
+        return entry->item()->second;
+    }
+
+    bool erase(const K& key) {
+        Entry* entry = *find_slot(key, hash_(key));
+        if (entry == nullptr) {
+            return false;
+        }
+        release(entry);
+        entry->chain = free_;
+        free_ = entry;
+        return true;
+    }
+
+    void clear() {
+        while (head_.next != &head_) {
+            Entry* entry = static_cast<Entry*>(head_.next);
+            release(entry);
+            entry->chain = free_;
+            free_ = entry;
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    size_t hits() const {
+        return hits_;
+    }
+
+    size_t misses() const {
+        return misses_;
+    }
+
+    size_t evictions() const {
+        return evictions_;
+    }
+};
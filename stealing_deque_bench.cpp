@@ -0,0 +1,114 @@
+// Throughput of StealingDeque against a Deque behind a std::mutex.
+//
+//   g++ -std=c++17 -O2 -pthread stealing_deque_bench.cpp
+//
+// The owner pushes N values and pops every third one back; the thieves
+// steal until everything has been taken. Reports millions of values moved
+// per second.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "deque.hpp"
+
+namespace {
+
+class LockedDeque {
+ private:
+  std::mutex mutex_;
+  Deque<int64_t> deque_;
+
+ public:
+  void push(int64_t value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    deque_.push_back(value);
+  }
+
+  bool pop(int64_t& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (deque_.size() == 0) {
+      return false;
+    }
+    value = deque_.back();
+    deque_.pop_back();
+    return true;
+  }
+
+  bool steal(int64_t& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (deque_.size() == 0) {
+      return false;
+    }
+    value = deque_.front();
+    deque_.pop_front();
+    return true;
+  }
+};
+
+template <typename Queue>
+double run(int thieves, int64_t count) {
+  Queue queue;
+  std::atomic<bool> done{false};
+  std::atomic<int64_t> sum{0};
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thieves; ++i) {
+    threads.emplace_back([&queue, &done, &sum] {
+      int64_t value;
+      int64_t local = 0;
+      while (!done.load(std::memory_order_acquire)) {
+        if (queue.steal(value)) {
+          local += value;
+        }
+      }
+      while (queue.steal(value)) {
+        local += value;
+      }
+      sum.fetch_add(local);
+    });
+  }
+
+  int64_t value;
+  int64_t local = 0;
+  for (int64_t i = 0; i < count; ++i) {
+    queue.push(i);
+    if (i % 3 == 0 && queue.pop(value)) {
+      local += value;
+    }
+  }
+  while (queue.pop(value)) {
+    local += value;
+  }
+  done.store(true, std::memory_order_release);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  sum.fetch_add(local);
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  if (sum.load() != count * (count - 1) / 2) {
+    std::printf("lost values\n");
+    std::exit(1);
+  }
+  return static_cast<double>(count) / elapsed.count() / 1e6;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int64_t count = argc > 1 ? std::atoll(argv[1]) : 20000000;
+  std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+  for (int thieves : {1, 3, 7}) {
+    double lock_free = run<StealingDeque<int64_t>>(thieves, count);
+    double locked = run<LockedDeque>(thieves, count);
+    std::printf("thieves %d: StealingDeque %.1f Mops/s, mutex Deque %.1f Mops/s\n",
+                thieves, lock_free, locked);
+  }
+  return 0;
+}
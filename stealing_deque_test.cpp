@@ -0,0 +1,83 @@
+// Multi-threaded stress test for StealingDeque.
+//
+//   g++ -std=c++17 -O1 -g -pthread -fsanitize=thread stealing_deque_test.cpp
+//
+// The owner pushes 0..N-1, pops some of them back and now and then drains
+// the deque, while the thieves keep stealing. Every value has to be taken
+// exactly once. Small RowSizes make the map grow (and retire) often while
+// thieves are reading it.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "deque.hpp"
+
+namespace {
+
+template <typename Queue>
+bool stress(const char* name, int thieves, int64_t count) {
+  Queue queue;
+  std::vector<std::atomic<int>> seen(count);
+  std::atomic<bool> done{false};
+
+  auto take = [&seen](int64_t value) { seen[value].fetch_add(1, std::memory_order_relaxed); };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thieves; ++i) {
+    threads.emplace_back([&queue, &done, &take] {
+      int64_t value;
+      while (!done.load(std::memory_order_acquire)) {
+        if (queue.steal(value)) {
+          take(value);
+        }
+      }
+      while (queue.steal(value)) {
+        take(value);
+      }
+    });
+  }
+
+  int64_t value;
+  for (int64_t i = 0; i < count; ++i) {
+    queue.push(i);
+    if (i % 3 == 0 && queue.pop(value)) {
+      take(value);
+    }
+    if (i % 100000 == 99999) {
+      while (queue.pop(value)) {
+        take(value);
+      }
+    }
+  }
+  while (queue.pop(value)) {
+    take(value);
+  }
+  done.store(true, std::memory_order_release);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (int64_t i = 0; i < count; ++i) {
+    int times = seen[i].load(std::memory_order_relaxed);
+    if (times != 1) {
+      std::printf("%s: value %lld taken %d times\n", name, static_cast<long long>(i), times);
+      return false;
+    }
+  }
+  std::printf("%s: ok\n", name);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int64_t count = argc > 1 ? std::atoll(argv[1]) : 1000000;
+  bool ok = true;
+  ok &= stress<StealingDeque<int64_t, std::allocator<int64_t>, 1>>("RowSize 1, 2 thieves", 2, count / 4);
+  ok &= stress<StealingDeque<int64_t, std::allocator<int64_t>, 4>>("RowSize 4, 3 thieves", 3, count);
+  ok &= stress<StealingDeque<int64_t>>("default RowSize, 4 thieves", 4, count);
+  return ok ? 0 : 1;
+}